@@ -1,3 +1,9 @@
+#include <algorithm>
+#include <vector>
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+
 #include "DataFormats/PortableVertex/interface/VertexHostCollection.h"
 #include "FWCore/ParameterSet/interface/ConfigurationDescriptions.h"
 #include "FWCore/ParameterSet/interface/ParameterSet.h"
@@ -21,16 +27,18 @@
    * This plugin takes the SoA portableVertex and converts them to reco::Vertex, for usage within other workflows
    * - consuming set of reco::Tracks and portablevertex SoA
    * - produces a host reco::vertexCollection
+   * Events with at least minVerticesForParallelConversion vertices fill the track references of the vertices in parallel
  */
 class SoAToRecoVertexProducer : public edm::stream::EDProducer<> {
   public:
-    SoAToRecoVertexProducer(edm::ParameterSet const& config) : portableVertexToken_(consumes(config.getParameter<edm::InputTag>("soaVertex"))), recoTrackToken_(consumes(config.getParameter<edm::InputTag>("srcTrack"))), recoVertexToken_(produces<reco::VertexCollection>()){
+    SoAToRecoVertexProducer(edm::ParameterSet const& config) : portableVertexToken_(consumes(config.getParameter<edm::InputTag>("soaVertex"))), recoTrackToken_(consumes(config.getParameter<edm::InputTag>("srcTrack"))), recoVertexToken_(produces<reco::VertexCollection>()), minVerticesForParallelConversion_(config.getParameter<int>("minVerticesForParallelConversion")){
     }
 
     static void fillDescriptions(edm::ConfigurationDescriptions& descriptions) {
       edm::ParameterSetDescription desc;
       desc.add<edm::InputTag>("soaVertex");
       desc.add<edm::InputTag>("srcTrack");
+      desc.add<int>("minVerticesForParallelConversion", 64); // Below this, the TBB task overhead is larger than the conversion itself
       
       descriptions.addWithDefaultLabel(desc);
     }
@@ -40,6 +48,7 @@ class SoAToRecoVertexProducer : public edm::stream::EDProducer<> {
     const edm::EDGetTokenT<portablevertex::VertexHostCollection> portableVertexToken_;
     const edm::EDGetTokenT<reco::TrackCollection> recoTrackToken_;
     const edm::EDPutTokenT<reco::VertexCollection> recoVertexToken_;
+    const int32_t minVerticesForParallelConversion_;
 };
 
 void SoAToRecoVertexProducer::produce(edm::Event& iEvent, const edm::EventSetup& iSetup){
@@ -51,24 +60,43 @@ void SoAToRecoVertexProducer::produce(edm::Event& iEvent, const edm::EventSetup&
   // This is an annoying conversion as the vertex expects a transient track here, which is a dataformat which we otherwise bypass
   auto result = std::make_unique<reco::VertexCollection>();
 
-  // Do the conversion back to reco::Vertex
+  // Rows of the vertices to convert, the collection is normally already compacted on the device but the isGood flag is still honoured
+  const int32_t nV = std::min(hostVertexView[0].nV(), hostVertexView.metadata().size());
+  std::vector<int32_t> goodRows;
+  goodRows.reserve(nV);
+  for (int iV = 0; iV < nV; iV++){
+    if (hostVertexView[iV].isGood()) goodRows.push_back(iV);
+  }
+
+  // Do the conversion back to reco::Vertex, first the vertices themselves, built in place
   reco::VertexCollection& vColl = (*result);
-  for (int iV = 0; iV < hostVertexView[0].nV() ; iV++){
-    if (not(hostVertexView[iV].isGood())) continue;
+  vColl.reserve(goodRows.size());
+  for (int32_t iV : goodRows){
     // Convert the SoA errors to a diagonal 3x3 matrix
     AlgebraicSymMatrix33 err;
     err[0][0] = hostVertexView[iV].errx();
     err[1][1] = hostVertexView[iV].erry();
     err[2][2] = hostVertexView[iV].errz();
-    // Then we can actually create the vertex
-    reco::Vertex newV(reco::Vertex::Point(hostVertexView[iV].x(), hostVertexView[iV].y(), hostVertexView[iV].z()), err, hostVertexView[iV].chi2(), hostVertexView[iV].ndof(), hostVertexView[iV].ntracks());
-    // Finally, add references to the reco::Track used for building it
+    // The last argument reserves the track reference list
+    vColl.emplace_back(reco::Vertex::Point(hostVertexView[iV].x(), hostVertexView[iV].y(), hostVertexView[iV].z()), err, hostVertexView[iV].chi2(), hostVertexView[iV].ndof(), hostVertexView[iV].ntracks());
+  }
+  // Then the references to the reco::Track used for building each of them, which is most of the work. Each vertex only touches its own lists, so they can be filled concurrently
+  auto addTracks = [&](size_t iGood){
+    const int32_t iV = goodRows[iGood];
+    reco::Vertex& newV = vColl[iGood];
     for (int iT=0; iT < hostVertexView[iV].ntracks(); iT++) {
        int new_itrack = hostVertexView[iV].track_id()[iT];
        reco::TrackRef ref(tracks, new_itrack);
        newV.add(ref, hostVertexView[iV].track_weight()[iT]);
     }
-    vColl.push_back(newV);
+  };
+  if (static_cast<int32_t>(goodRows.size()) >= minVerticesForParallelConversion_){
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, goodRows.size()), [&](const tbb::blocked_range<size_t>& range){
+      for (size_t iGood = range.begin(); iGood < range.end(); iGood++) addTracks(iGood);
+    });
+  }
+  else{
+    for (size_t iGood = 0; iGood < goodRows.size(); iGood++) addTracks(iGood);
   }
   // And finally put the collection in the event
   iEvent.put(std::move(result));
@@ -1,89 +1,157 @@
 #include <alpaka/alpaka.hpp>
+#include <algorithm>
 #include <cmath>
+#include <limits>
 #include "HeterogeneousCore/AlpakaInterface/interface/config.h"
 #include "HeterogeneousCore/AlpakaInterface/interface/workdivision.h"
 
 #include "RecoVertex/PrimaryVertexProducer_Alpaka/plugins/alpaka/BlockAlgo.h"
+#include "RecoVertex/PrimaryVertexProducer_Alpaka/plugins/alpaka/BlockPrimitives.h"
 
-#define DEBUG_RECOVERTEX_PRIMARYVERTEXPRODUCER_ALPAKA_BLOCKALGO 1
+//#define DEBUG_RECOVERTEX_PRIMARYVERTEXPRODUCER_ALPAKA_BLOCKALGO 1
 
 namespace ALPAKA_ACCELERATOR_NAMESPACE {
-  using namespace cms::alpakatools; 
+  using namespace cms::alpakatools;
+
+  // Blocks are index ranges over the z-sorted input tracks: block b is made of the blockTrackCount[b] tracks starting at blockTrackStart[b]
+  // Only z, weight and oneoverdz2 are copied to per-slot workspace arrays, the clusterizer reads the rest of the input collection through these ranges (see blockTracks)
 
   class createBlocksKernel {
   public:
     template <typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>>
-    ALPAKA_FN_ACC void operator()(const TAcc& acc,  const portablevertex::TrackDeviceCollection::ConstView inputTracks,  portablevertex::TrackDeviceCollection::View trackInBlocks, double blockOverlap, int32_t blockSize) const{
+    ALPAKA_FN_ACC void operator()(const TAcc& acc,  const portablevertex::TrackDeviceCollection::ConstView inputTracks, int32_t* blockTrackStart, int32_t* blockTrackCount, double* blockZRange, double blockOverlap, int32_t blockSize, int32_t nBlocks) const{
       #ifdef DEBUG_RECOVERTEX_PRIMARYVERTEXPRODUCER_ALPAKA_BLOCKALGO
-        printf("[BlockAlgo::operator()] Start\n");
-        printf("[BlockAlgo::operator()] blockOverlap: %1.3f, blockSize %i\n",blockOverlap, blockSize);
+        if (once_per_grid(acc)) printf("[BlockAlgo::operator()] blockOverlap: %1.3f, blockSize %i, nBlocks %i\n",blockOverlap, blockSize, nBlocks);
       #endif
       int32_t nTOld = inputTracks.nT();
-      #ifdef DEBUG_RECOVERTEX_PRIMARYVERTEXPRODUCER_ALPAKA_BLOCKALGO
-        printf("[BlockAlgo::operator()] blockSize: %i, blockOverlap %1.3f, nTOld %i\n", blockSize, blockOverlap, nTOld);
-      #endif
-      int32_t nBlocks = nTOld > blockSize ? int32_t ((nTOld-1)/(blockOverlap*blockSize)) : 1; // If all fit within a block, no need to split
-      #ifdef DEBUG_RECOVERTEX_PRIMARYVERTEXPRODUCER_ALPAKA_BLOCKALGO
-        printf("[BlockAlgo::operator()] nBlocks: %i\n", nBlocks);
-      #endif
       int32_t overlapStart = blockOverlap*blockSize; // First block starts at 0, second block starts at overlapStart, third at 2*overlapStart and so on
-      #ifdef DEBUG_RECOVERTEX_PRIMARYVERTEXPRODUCER_ALPAKA_BLOCKALGO
-        printf("[BlockAlgo::operator()] blockSize: %i\n", blockSize);
-      #endif
-      for (auto iNewTrack : elements_with_stride(acc, blockSize) ) { // The accelerator has as much threads as blockSize, so each thread will enter once on each block
-	#ifdef DEBUG_RECOVERTEX_PRIMARYVERTEXPRODUCER_ALPAKA_BLOCKALGO
-	  printf("[BlockAlgo::operator()] iNewTrack %i, nBlocks %i\n", iNewTrack, nBlocks);
-	#endif 
-        for (int32_t iblock = 0; iblock < nBlocks; iblock++){
-      	  int32_t oldIndex = (iblock*overlapStart) + iNewTrack; // I.e. first track in the block in which we are + thread in which we are
-	  if (oldIndex >= nTOld) break; // I.e. we reached the end of the input block
-          int32_t newIndex = iNewTrack+iblock*blockSize;
-	  #ifdef DEBUG_RECOVERTEX_PRIMARYVERTEXPRODUCER_ALPAKA_BLOCKALGO
-	    printf("[BlockAlgo::operator()] iblock %i, oldIndex %i => newIndex %i, x: %1.5f, y: %1.5f, z:%1.5f\n", iblock, oldIndex, newIndex, inputTracks[oldIndex].x(),inputTracks[oldIndex].y(), inputTracks[oldIndex].z());
-	  #endif
-	  // And just copy in new places
-	  trackInBlocks[newIndex].x()          = inputTracks[oldIndex].x();
-          trackInBlocks[newIndex].y()          = inputTracks[oldIndex].y();
-          trackInBlocks[newIndex].z()          = inputTracks[oldIndex].z();
-          trackInBlocks[newIndex].px()         = inputTracks[oldIndex].px();
-          trackInBlocks[newIndex].py()         = inputTracks[oldIndex].py();
-          trackInBlocks[newIndex].pz()         = inputTracks[oldIndex].pz();
-          trackInBlocks[newIndex].weight()     = inputTracks[oldIndex].weight();
-          trackInBlocks[newIndex].tt_index()   = inputTracks[oldIndex].tt_index(); // Relevant to keep the index at hand, as it lets us merge tracks later
-          trackInBlocks[newIndex].dz2()        = inputTracks[oldIndex].dz2();
-          trackInBlocks[newIndex].oneoverdz2() = inputTracks[oldIndex].oneoverdz2();
-          trackInBlocks[newIndex].dxy2AtIP()   = inputTracks[oldIndex].dxy2AtIP();
-          trackInBlocks[newIndex].dxy2()       = inputTracks[oldIndex].dxy2();
-          trackInBlocks[newIndex].sum_Z()      = inputTracks[oldIndex].order();
-          trackInBlocks[newIndex].kmin()       = inputTracks[oldIndex].kmin();
-          trackInBlocks[newIndex].kmax()       = inputTracks[oldIndex].kmax();
-          trackInBlocks[newIndex].aux1()       = inputTracks[oldIndex].aux1();
-          trackInBlocks[newIndex].aux2()       = inputTracks[oldIndex].aux2();
-          trackInBlocks[newIndex].isGood()     = inputTracks[oldIndex].isGood();
-	} // iblock for
-      } // iNewTrack for
-      if (once_per_block(acc)){
-        trackInBlocks.nT() = (nBlocks-1)*blockSize + nTOld-blockSize*std::floor(nTOld/(blockOverlap*blockSize));
+      for (auto iblock : elements_with_stride(acc, nBlocks)){ // One thread per block
+        int32_t start = std::min(nTOld, iblock*overlapStart);
+        blockTrackStart[iblock] = start;
+        blockTrackCount[iblock] = std::min(blockSize, nTOld - start); // The last block is padded up to blockSize, blocks past the end are empty
+        // Overlapping blocks find the same vertices, the arbitration sorts them out
+        blockZRange[2*iblock]     = -std::numeric_limits<double>::infinity();
+        blockZRange[2*iblock + 1] = std::numeric_limits<double>::infinity();
       }
-      #ifdef DEBUG_RECOVERTEX_PRIMARYVERTEXPRODUCER_ALPAKA_BLOCKALGO
-        printf("[BlockAlgo::operator()] End\n");
-      #endif
     } // createBlocksKernel::operator()
   }; // class createBlocksKernel
 
+  class createGapBlocksKernel {
+  public:
+    template <typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>>
+    ALPAKA_FN_ACC void operator()(const TAcc& acc,  const portablevertex::TrackDeviceCollection::ConstView inputTracks, int32_t* blockTrackStart, int32_t* blockTrackCount, double* blockZRange, int32_t blockSize, int32_t halo, int32_t nBlocks) const{
+      // The z-sorted tracks are cut into consecutive cores of at most blockSize-2*halo tracks. Each cut goes to the largest z gap in the second half of the allowed core length, so boundaries avoid dense regions and every core but the last has at least half the allowed length
+      // Each block holds its core plus halo tracks on each side, and only keeps the vertices between the middles of its two boundary gaps. Cuts are found one after the other, with all threads working on each
+      int nThreads  = alpaka::getWorkDiv<alpaka::Block, alpaka::Threads>(acc)[0u]; // Threads per block, 1 on the CPU backends
+      int threadIdx = alpaka::getIdx<alpaka::Block, alpaka::Threads>(acc)[0u]; // Thread number inside block
+      auto& scratch = alpaka::declareSharedVar<blockScratch, __COUNTER__>(acc);
+      int32_t nTOld = inputTracks.nT();
+      int32_t coreMax = blockSize - 2*halo;
+      int32_t coreMin = coreMax/2;
+      int32_t start = 0; // First core track of the current block
+      for (int32_t iblock = 0; iblock < nBlocks; iblock++){
+        int32_t end = nTOld; // One past the last core track
+        if (nTOld - start > coreMax){
+          double bestGap = -1.;
+          int32_t bestCut = -1;
+          for (int32_t cut = start + coreMin + threadIdx; cut <= start + coreMax; cut += nThreads){ // Cutting before track cut, ties go to the first one
+            double gap = inputTracks[cut].z() - inputTracks[cut - 1].z();
+            if (gap > bestGap){
+              bestGap = gap;
+              bestCut = cut;
+            }
+          }
+          end = blockArgMax(acc, scratch, bestGap, bestCut);
+        }
+        if (once_per_block(acc)){
+          bool empty = start >= nTOld; // The block count is an upper bound, blocks past the last track stay empty
+          int32_t first = empty ? nTOld : std::max(0, start - halo);
+          blockTrackStart[iblock] = first;
+          blockTrackCount[iblock] = empty ? 0 : std::min(nTOld, end + halo) - first;
+          blockZRange[2*iblock]     = empty ? std::numeric_limits<double>::infinity() : (start == 0 ? -std::numeric_limits<double>::infinity() : 0.5*(inputTracks[start - 1].z() + inputTracks[start].z()));
+          blockZRange[2*iblock + 1] = empty ? -std::numeric_limits<double>::infinity() : (end >= nTOld ? std::numeric_limits<double>::infinity() : 0.5*(inputTracks[end - 1].z() + inputTracks[end].z()));
+        }
+        start = std::max(start, end);
+      } // iblock for
+    } // createGapBlocksKernel::operator()
+  }; // class createGapBlocksKernel
+
+  class gatherBlockTracksKernel {
+  public:
+    template <typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>>
+    ALPAKA_FN_ACC void operator()(const TAcc& acc,  const portablevertex::TrackDeviceCollection::ConstView inputTracks, const int32_t* blockTrackStart, const int32_t* blockTrackCount, double* trackZ, double* trackWeight, double* trackOneOverDz2, int32_t blockSize, int32_t nSlots) const{
+      // Copies the three columns the annealing reads on every iteration into contiguous per-slot arrays, one thread per track slot
+      for (auto slot : elements_with_stride(acc, nSlots)){
+        int32_t block = slot / blockSize;
+        int32_t i = slot - block * blockSize;
+        int32_t count = blockTrackCount[block];
+        if (i < count){
+          int32_t itrack = blockTrackStart[block] + i;
+          trackZ[slot] = inputTracks[itrack].z();
+          trackWeight[slot] = inputTracks[itrack].weight();
+          trackOneOverDz2[slot] = inputTracks[itrack].oneoverdz2();
+        }
+        else{ // Padding does not contribute, and repeats the last z of the block so the slots stay sorted
+          trackZ[slot] = count > 0 ? inputTracks[blockTrackStart[block] + count - 1].z() : 0.;
+          trackWeight[slot] = 0.;
+          trackOneOverDz2[slot] = 0.;
+        }
+      }
+    } // gatherBlockTracksKernel::operator()
+  }; // class gatherBlockTracksKernel
+
   BlockAlgo::BlockAlgo() {
   } // BlockAlgo::BlockAlgo
-  
-  void BlockAlgo::createBlocks(Queue& queue, const portablevertex::TrackDeviceCollection& inputTracks, portablevertex::TrackDeviceCollection& trackInBlocks, int32_t bSize, double bOverlap){
-    const int threadsPerBlock = bSize;// each thread will write nBlocks tracks
-    const int blocks = 1;             // 1 block with all threads
+
+  int32_t BlockAlgo::nBlocks(int32_t nTracks, int32_t bSize, double bOverlap, int32_t partitioning, int32_t halo){
+    if (nTracks <= bSize) return 1; // If the block size is big enough we process everything at once
+    if (partitioning == partitionZGaps){
+      // Every core but the last has at least coreMax/2 tracks, and the last one takes the rest once it fits in coreMax
+      int32_t coreMax = bSize - 2*std::min(halo, bSize/4);
+      int32_t coreMin = coreMax/2;
+      return 1 + std::max(0, (nTracks - coreMax + coreMin - 1)/coreMin);
+    }
+    return int32_t ((nTracks-1)/(bOverlap*bSize));
+  } // BlockAlgo::nBlocks
+
+  void BlockAlgo::createBlocks(Queue& queue, const portablevertex::TrackDeviceCollection& inputTracks, int32_t bSize, double bOverlap, int32_t partitioning, int32_t halo, int32_t nBlocks, const clusterizerWorkspace& ws){
+    if (partitioning == partitionZGaps){
+      alpaka::exec<Acc1D>(queue,
+		          make_workdiv<Acc1D>(1, bSize), // 1 block with all threads, as each cut depends on the previous one
+			  createGapBlocksKernel{},
+			  inputTracks.view(),
+			  ws.blockTrackStart,
+			  ws.blockTrackCount,
+			  ws.blockZRange,
+			  bSize,
+			  std::min(halo, bSize/4), // Keeps at least half of each block for the core
+			  nBlocks
+			  );
+    }
+    else{
+      alpaka::exec<Acc1D>(queue,
+		          make_workdiv<Acc1D>(divide_up_by(nBlocks, bSize), bSize),
+			  createBlocksKernel{},
+			  inputTracks.view(),
+			  ws.blockTrackStart,
+			  ws.blockTrackCount,
+			  ws.blockZRange,
+			  bOverlap,
+			  bSize,
+			  nBlocks
+			  );
+    }
     alpaka::exec<Acc1D>(queue,
-		        make_workdiv<Acc1D>(blocks, threadsPerBlock),
-			createBlocksKernel{},
+		        make_workdiv<Acc1D>(nBlocks, bSize), // One thread per track slot
+			gatherBlockTracksKernel{},
 			inputTracks.view(),
-			trackInBlocks.view(),
-			bOverlap,
-			bSize
-			); 
+			ws.blockTrackStart,
+			ws.blockTrackCount,
+			ws.trackZ,
+			ws.trackWeight,
+			ws.trackOneOverDz2,
+			bSize,
+			nBlocks*bSize
+			);
   } // BlockAlgo::createBlocks
 } // namespace ALPAKA_ACCELERATOR_NAMESPACE
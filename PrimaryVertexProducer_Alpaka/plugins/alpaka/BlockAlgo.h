@@ -4,12 +4,21 @@
 #include "DataFormats/PortableVertex/interface/alpaka/VertexDeviceCollection.h"
 #include "HeterogeneousCore/AlpakaInterface/interface/config.h"
 
+#include "RecoVertex/PrimaryVertexProducer_Alpaka/plugins/alpaka/ClusterizerAlgo.h"
+
 namespace ALPAKA_ACCELERATOR_NAMESPACE {
 
+  // How the z-sorted tracks are cut into blocks
+  enum blockPartitioningModes : int32_t {
+    partitionFixedOverlap = 0, // Fixed-size blocks, each starting blockOverlap*blockSize tracks after the previous one
+    partitionZGaps = 1         // Variable-size blocks cut at the largest z gaps, with only a halo of tracks shared with the neighbours
+  };
+
   class BlockAlgo {
   public:
     BlockAlgo();
-    void createBlocks(Queue& queue, const portablevertex::TrackDeviceCollection& inputTrack, portablevertex::TrackDeviceCollection& trackInBlocks, int32_t blockSize, double blockOverlap); // The actual block creation
+    static int32_t nBlocks(int32_t nTracks, int32_t blockSize, double blockOverlap, int32_t partitioning, int32_t halo); // Number of blocks to allocate for nTracks tracks, an upper bound for partitionZGaps
+    void createBlocks(Queue& queue, const portablevertex::TrackDeviceCollection& inputTrack, int32_t blockSize, double blockOverlap, int32_t partitioning, int32_t halo, int32_t nBlocks, const clusterizerWorkspace& ws); // The actual block creation: fills the track ranges of the blocks and the z range each block keeps vertices in
 
   private:
   };
@@ -0,0 +1,190 @@
+#ifndef RecoVertex_PrimaryVertexProducer_Alpaka_plugins_alpaka_BlockPrimitives_h
+#define RecoVertex_PrimaryVertexProducer_Alpaka_plugins_alpaka_BlockPrimitives_h
+
+#include <algorithm>
+#include <limits>
+
+#include <alpaka/alpaka.hpp>
+
+#include "HeterogeneousCore/AlpakaInterface/interface/config.h"
+
+namespace ALPAKA_ACCELERATOR_NAMESPACE {
+  /**
+   * Block-wide collective operations used by the clusterizer
+   * - all threads of the block must call them, with the same arguments where it applies, and all of them get the result
+   * - the shared memory they work in is a blockScratchOf with room for the threads of the block, declared by the calling kernel
+   * - results do not depend on the thread scheduling: the combination order is fixed by the thread index, so repeated runs give bit-identical sums
+   * - a single thread per block (CPU backends) just returns its own value
+   */
+  constexpr int maxBlockThreads = 1024; // Largest block size supported, sets the size of the default shared scratch
+
+  // Shared scratch of the operations below, for blocks of at most maxThreads threads. They run one after the other and end with a sync, so a kernel declares a single one with declareSharedVar and passes it to all of its calls
+  template <int maxThreads>
+  struct blockScratchOf {
+    double value[maxThreads];
+    int32_t index[maxThreads];
+  };
+  using blockScratch = blockScratchOf<maxBlockThreads>; // Fits any block, kernels always launched with small blocks declare a smaller one to save shared memory
+
+  template <typename TAcc, int maxThreads, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC double blockSum(const TAcc& acc, blockScratchOf<maxThreads>& scratch, double value){
+    // Pairwise tree sum of one value per thread
+    int nThreads  = alpaka::getWorkDiv<alpaka::Block, alpaka::Threads>(acc)[0u]; // Threads per block, 1 on the CPU backends
+    int threadIdx = alpaka::getIdx<alpaka::Block, alpaka::Threads>(acc)[0u]; // Thread number inside block
+    double* partial = scratch.value;
+    partial[threadIdx] = value;
+    alpaka::syncBlockThreads(acc);
+    for (int active = nThreads; active > 1; active = (active + 1) / 2){ // Fold the upper half onto the lower half until one value is left
+      int half = (active + 1) / 2;
+      if (threadIdx < active - half) partial[threadIdx] += partial[threadIdx + half];
+      alpaka::syncBlockThreads(acc);
+    }
+    double result = partial[0];
+    alpaka::syncBlockThreads(acc); // The scratch is reused by the next call
+    return result;
+  }
+
+  template <typename TAcc, int maxThreads, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC double blockMax(const TAcc& acc, blockScratchOf<maxThreads>& scratch, double value){
+    // Tree maximum of one value per thread
+    int nThreads  = alpaka::getWorkDiv<alpaka::Block, alpaka::Threads>(acc)[0u]; // Threads per block, 1 on the CPU backends
+    int threadIdx = alpaka::getIdx<alpaka::Block, alpaka::Threads>(acc)[0u]; // Thread number inside block
+    double* partial = scratch.value;
+    partial[threadIdx] = value;
+    alpaka::syncBlockThreads(acc);
+    for (int active = nThreads; active > 1; active = (active + 1) / 2){
+      int half = (active + 1) / 2;
+      if (threadIdx < active - half) partial[threadIdx] = std::max(partial[threadIdx], partial[threadIdx + half]);
+      alpaka::syncBlockThreads(acc);
+    }
+    double result = partial[0];
+    alpaka::syncBlockThreads(acc); // The scratch is reused by the next call
+    return result;
+  }
+
+  template <typename TAcc, int maxThreads, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC int blockArgMax(const TAcc& acc, blockScratchOf<maxThreads>& scratch, double value, int index){
+    // Tree search of the index carrying the largest value, one (value, index) candidate per thread. Ties go to the smallest index, threads without a candidate pass index -1
+    int nThreads  = alpaka::getWorkDiv<alpaka::Block, alpaka::Threads>(acc)[0u]; // Threads per block, 1 on the CPU backends
+    int threadIdx = alpaka::getIdx<alpaka::Block, alpaka::Threads>(acc)[0u]; // Thread number inside block
+    double* partialValue = scratch.value;
+    int32_t* partialIndex = scratch.index;
+    partialValue[threadIdx] = value;
+    partialIndex[threadIdx] = index;
+    alpaka::syncBlockThreads(acc);
+    for (int active = nThreads; active > 1; active = (active + 1) / 2){
+      int half = (active + 1) / 2;
+      if (threadIdx < active - half){
+        int other = threadIdx + half;
+        bool otherWins = (partialIndex[other] >= 0) && ((partialIndex[threadIdx] < 0) || (partialValue[other] > partialValue[threadIdx]) || ((partialValue[other] == partialValue[threadIdx]) && (partialIndex[other] < partialIndex[threadIdx])));
+        if (otherWins){
+          partialValue[threadIdx] = partialValue[other];
+          partialIndex[threadIdx] = partialIndex[other];
+        }
+      }
+      alpaka::syncBlockThreads(acc);
+    }
+    int result = partialIndex[0];
+    alpaka::syncBlockThreads(acc); // The scratch is reused by the next call
+    return result;
+  }
+
+  template <typename TAcc, int maxThreads, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC int32_t blockExclusiveScan(const TAcc& acc, blockScratchOf<maxThreads>& scratch, int32_t* data, int n){
+    // In-place exclusive prefix sum of data[0, n), which can live in global or shared memory. Returns the total
+    // Each thread scans a contiguous chunk serially, then the chunk totals are scanned across threads in log(nThreads) steps
+    int nThreads  = alpaka::getWorkDiv<alpaka::Block, alpaka::Threads>(acc)[0u]; // Threads per block, 1 on the CPU backends
+    int threadIdx = alpaka::getIdx<alpaka::Block, alpaka::Threads>(acc)[0u]; // Thread number inside block
+    int32_t* partial = scratch.index;
+    int chunk = (n + nThreads - 1) / nThreads;
+    int begin = std::min(n, threadIdx * chunk);
+    int end   = std::min(n, begin + chunk);
+    int32_t chunkSum = 0;
+    for (int i = begin; i < end; i++) chunkSum += data[i];
+    partial[threadIdx] = chunkSum;
+    alpaka::syncBlockThreads(acc);
+    for (int offset = 1; offset < nThreads; offset *= 2){ // Inclusive scan of the chunk totals
+      int32_t other = threadIdx >= offset ? partial[threadIdx - offset] : 0;
+      alpaka::syncBlockThreads(acc);
+      partial[threadIdx] += other;
+      alpaka::syncBlockThreads(acc);
+    }
+    int32_t running = partial[threadIdx] - chunkSum;
+    for (int i = begin; i < end; i++){
+      int32_t value = data[i];
+      data[i] = running;
+      running += value;
+    }
+    int32_t total = partial[nThreads - 1];
+    alpaka::syncBlockThreads(acc); // The scratch is reused by the next call, and data is complete for everyone
+    return total;
+  }
+
+  template <typename TAcc, int maxThreads, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC void blockInclusiveMaxScan(const TAcc& acc, blockScratchOf<maxThreads>& scratch, int32_t* data, int n){
+    // In-place running maximum of data[0, n), same chunked layout as blockExclusiveScan
+    int nThreads  = alpaka::getWorkDiv<alpaka::Block, alpaka::Threads>(acc)[0u]; // Threads per block, 1 on the CPU backends
+    int threadIdx = alpaka::getIdx<alpaka::Block, alpaka::Threads>(acc)[0u]; // Thread number inside block
+    int32_t* partial = scratch.index;
+    int chunk = (n + nThreads - 1) / nThreads;
+    int begin = std::min(n, threadIdx * chunk);
+    int end   = std::min(n, begin + chunk);
+    int32_t chunkMax = std::numeric_limits<int32_t>::min();
+    for (int i = begin; i < end; i++) chunkMax = std::max(chunkMax, data[i]);
+    partial[threadIdx] = chunkMax;
+    alpaka::syncBlockThreads(acc);
+    for (int offset = 1; offset < nThreads; offset *= 2){ // Inclusive scan of the chunk maxima
+      int32_t other = threadIdx >= offset ? partial[threadIdx - offset] : std::numeric_limits<int32_t>::min();
+      alpaka::syncBlockThreads(acc);
+      partial[threadIdx] = std::max(partial[threadIdx], other);
+      alpaka::syncBlockThreads(acc);
+    }
+    int32_t running = threadIdx > 0 ? partial[threadIdx - 1] : std::numeric_limits<int32_t>::min();
+    for (int i = begin; i < end; i++){
+      running = std::max(running, data[i]);
+      data[i] = running;
+    }
+    alpaka::syncBlockThreads(acc); // The scratch is reused by the next call, and data is complete for everyone
+  }
+
+  template <typename TAcc, int maxThreads, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC double blockSegmentedSum(const TAcc& acc, blockScratchOf<maxThreads>& scratch, double value, int32_t segment, bool& last){
+    // Sum of the values of the threads in the same segment, from the first one up to this one. segment must not decrease with the thread index
+    // last tells whether this thread is the last of its segment, in which case the result is the segment total
+    int nThreads  = alpaka::getWorkDiv<alpaka::Block, alpaka::Threads>(acc)[0u]; // Threads per block, 1 on the CPU backends
+    int threadIdx = alpaka::getIdx<alpaka::Block, alpaka::Threads>(acc)[0u]; // Thread number inside block
+    double* partialValue = scratch.value;
+    int32_t* partialSegment = scratch.index;
+    partialValue[threadIdx] = value;
+    partialSegment[threadIdx] = segment;
+    alpaka::syncBlockThreads(acc);
+    last = (threadIdx == nThreads - 1) || (partialSegment[threadIdx + 1] != segment);
+    for (int offset = 1; offset < nThreads; offset *= 2){ // Segments are contiguous, so stopping at the first thread of another segment is enough
+      double other = ((threadIdx >= offset) && (partialSegment[threadIdx - offset] == segment)) ? partialValue[threadIdx - offset] : 0.;
+      alpaka::syncBlockThreads(acc);
+      partialValue[threadIdx] += other;
+      alpaka::syncBlockThreads(acc);
+    }
+    double result = partialValue[threadIdx];
+    alpaka::syncBlockThreads(acc); // The scratch is reused by the next call
+    return result;
+  }
+
+  template <typename TAcc, int maxThreads, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC int32_t blockCompact(const TAcc& acc, blockScratchOf<maxThreads>& scratch, int32_t* list, int32_t* flags, int32_t* staging, int n, int32_t* dropped = nullptr){
+    // Stable removal of the entries of list[0, n) with flags[i] == 0, in one parallel pass. Returns the new size
+    // flags needs n+1 entries: on return flags[i] is the new position of entry i, or of the first entry kept after it, and flags[n] is the new size
+    // staging needs n entries. If given, dropped gets the removed entries, in their original order
+    int nThreads  = alpaka::getWorkDiv<alpaka::Block, alpaka::Threads>(acc)[0u]; // Threads per block, 1 on the CPU backends
+    int threadIdx = alpaka::getIdx<alpaka::Block, alpaka::Threads>(acc)[0u]; // Thread number inside block
+    if (threadIdx == 0) flags[n] = 0;
+    alpaka::syncBlockThreads(acc);
+    int32_t nKept = blockExclusiveScan(acc, scratch, flags, n + 1);
+    for (int i = threadIdx; i < n; i += nThreads){
+      if (flags[i + 1] > flags[i]) staging[flags[i]] = list[i]; // Kept entries are the ones where the scan steps up
+      else if (dropped) dropped[i - flags[i]] = list[i]; // i - flags[i] entries were dropped before this one
+    }
+    alpaka::syncBlockThreads(acc);
+    for (int i = threadIdx; i < nKept; i += nThreads){
+      list[i] = staging[i];
+    }
+    alpaka::syncBlockThreads(acc);
+    return nKept;
+  }
+
+}  // namespace ALPAKA_ACCELERATOR_NAMESPACE
+
+#endif  // RecoVertex_PrimaryVertexProducer_Alpaka_plugins_alpaka_BlockPrimitives_h
@@ -1,9 +1,10 @@
 #include <alpaka/alpaka.hpp>
+#include <limits>
 
 #include "HeterogeneousCore/AlpakaInterface/interface/config.h"
 #include "HeterogeneousCore/AlpakaInterface/interface/workdivision.h"
-#include "HeterogeneousCore/AlpakaInterface/interface/radixSort.h"
 
+#include "RecoVertex/PrimaryVertexProducer_Alpaka/plugins/alpaka/BlockPrimitives.h"
 #include "RecoVertex/PrimaryVertexProducer_Alpaka/plugins/alpaka/ClusterizerAlgo.h"
 
 namespace ALPAKA_ACCELERATOR_NAMESPACE {
@@ -12,450 +13,565 @@ namespace ALPAKA_ACCELERATOR_NAMESPACE {
   // Device functions //
   //////////////////////
 
-   template <bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void set_vtx_range(const TAcc& acc, portablevertex::TrackDeviceCollection::View tracks, portablevertex::VertexDeviceCollection::View vertices, const portablevertex::ClusterParamsHostCollection::ConstView cParams, double& osumtkwt, double& _beta){
+  template <typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static int32_t allocateVertex(const TAcc& acc, const clusterizerWorkspace ws){
+    // Get a vertex slot for this block: first reuse the ones the block gave back, otherwise take a new one from the pool shared by all blocks. Returns -1 if the pool is exhausted
+    // Only one thread per block should call this
+    int blockIdx  = alpaka::getIdx<alpaka::Grid, alpaka::Blocks>(acc)[0u]; // Block number inside grid
+    if (ws.nFreeSlots[blockIdx] > 0){
+      ws.nFreeSlots[blockIdx]--;
+      return ws.freeSlots[ws.maxVerticesPerBlock * blockIdx + ws.nFreeSlots[blockIdx]];
+    }
+    int32_t ivertex = alpaka::atomicAdd(acc, ws.poolTop, 1, alpaka::hierarchy::Blocks{}); // Bump allocation, the counter might go past the end, which just means the pool is full
+    return ivertex < ws.maxVertices ? ivertex : -1;
+  }
+
+  ALPAKA_FN_ACC static int lowerBound(const double* values, int n, double value){
+    // Binary search in a sorted array: first entry with values[i] >= value, n if there is none
+    int low = 0;
+    int high = n;
+    while (low < high){
+      int mid = (low + high) / 2;
+      if (values[mid] < value) low = mid + 1;
+      else high = mid;
+    }
+    return low;
+  }
+
+  ALPAKA_FN_ACC static int upperBound(const double* values, int n, double value){
+    // Binary search in a sorted array: first entry with values[i] > value, n if there is none
+    int low = 0;
+    int high = n;
+    while (low < high){
+      int mid = (low + high) / 2;
+      if (values[mid] <= value) low = mid + 1;
+      else high = mid;
+    }
+    return low;
+  }
+
+  template <typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void refreshOrderedZ(const TAcc& acc, portablevertex::VertexDeviceCollection::View vertices, const clusterizerWorkspace ws){
+    // Rebuild the dense z copy of the ordered list of the block after the list itself changed
+    int nThreads  = alpaka::getWorkDiv<alpaka::Block, alpaka::Threads>(acc)[0u]; // Threads per block, 1 on the CPU backends
+    int threadIdx = alpaka::getIdx<alpaka::Block, alpaka::Threads>(acc)[0u]; // Thread number inside block
+    int blockIdx  = alpaka::getIdx<alpaka::Grid, alpaka::Blocks>(acc)[0u]; // Block number inside grid
+    int maxVerticesPerBlock = ws.maxVerticesPerBlock; // Capacity of the ordered vertex list of each block
+    for (int k = threadIdx; k < vertices[blockIdx].nV() ; k += nThreads){
+      ws.orderedZ[k] = vertices[ws.order[maxVerticesPerBlock * blockIdx + k]].z();
+    }
+    alpaka::syncBlockThreads(acc);
+  }
+
+  template <bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void set_vtx_range(const TAcc& acc, const blockTracks tracks, portablevertex::VertexDeviceCollection::View vertices, const ClusterParamsCollection::ConstView cParams, const clusterizerWorkspace ws, double& osumtkwt, double& _beta){
     // These updates the range of vertices associated to each track through the kmin/kmax variables
-    int blockSize = alpaka::getWorkDiv<alpaka::Grid, alpaka::Blocks>(acc)[0u];
+    int blockSize = ws.blockSize; // Tracks per block
+    int nThreads  = alpaka::getWorkDiv<alpaka::Block, alpaka::Threads>(acc)[0u]; // Threads per block, 1 on the CPU backends
     int threadIdx = alpaka::getIdx<alpaka::Block, alpaka::Threads>(acc)[0u]; // Thread number inside block
     int blockIdx  = alpaka::getIdx<alpaka::Grid, alpaka::Blocks>(acc)[0u]; // Block number inside grid
-    int maxVerticesPerBlock = (int) 512/blockSize; // Max vertices size is 512 over number of blocks in grid
+    int maxVerticesPerBlock = ws.maxVerticesPerBlock; // Capacity of the ordered vertex list of each block
     double zrange_min_= 0.1; // Hard coded as in CPU version
-    for (int itrack = threadIdx+blockIdx*blockSize; itrack < threadIdx+(blockIdx+1)*blockSize ; itrack += blockSize){ // TODO:Saving and reading in the tracks dataformat might be a bit too much?
+    int base = maxVerticesPerBlock * blockIdx; // First position of the ordered list of this block
+    int nV = vertices[blockIdx].nV();
+    const double* orderedZ = ws.orderedZ; // Dense z of the ordered list, so the search does not go through order
+    for (int itrack = threadIdx+blockIdx*blockSize; itrack < (blockIdx+1)*blockSize ; itrack += nThreads){ // TODO:Saving and reading in the tracks dataformat might be a bit too much?
       // Based on current temperature (regularization term) and track position uncertainty, only keep relevant vertices
-      double zrange     = std::max(cParams.zrange()/ sqrt((_beta) * tracks[itrack].oneoverdz2()), zrange_min_);
-      double zmin       = tracks[itrack].z() - zrange;
-      // First the lower bound
-      int kmin = std::min((int) (maxVerticesPerBlock * blockIdx) + vertices.nV(blockIdx) - 1,  tracks[itrack].kmin()); //We might have deleted a vertex, so be careful if the track is in one extreme of the axis
-      if (vertices[vertices[kmin].order()].z() > zmin){ // If the vertex position in z is bigger than the minimum, go down through all vertices position until finding one that is too far
-          while ((kmin > maxVerticesPerBlock * blockIdx) && ((vertices[vertices[kmin-1].order()].z()) > zmin)) { // i.e., while we find another vertex within range that is before the previous initial step
-          kmin--;
-        }
-      }
-      else { // Otherwise go up
-        while ((kmin < (maxVerticesPerBlock * blockIdx + (int) (vertices[blockIdx].nV()) - 1)) && ((vertices[vertices[kmin].order()].z()) < zmin)) { // Or it might happen that we have to take out vertices from the thing
-          kmin++;
-        }
-      }
-      // And now do the same for the upper bound
-      double zmax       = tracks[itrack].z() + zrange;
-      int kmax = std::min(maxVerticesPerBlock * blockIdx + (int) (vertices[blockIdx].nV()) - 1, (int) (tracks[itrack].kmax()) - 1);
-      if (vertices[vertices[kmax].order()].z() < zmax) {
-        while ((kmax < (maxVerticesPerBlock * blockIdx + (int) (vertices[blockIdx].nV())  - 1)) && ((vertices[vertices[kmax+1].order()].z()) < zmax)) { // As long as we have more vertex above kmax but within z range, we can add them to the collection, keep going
-          kmax++;
-        }
-      }
-      else { //Or maybe we have to restrict it
-        while ((kmax > maxVerticesPerBlock * blockIdx) && (vertices[vertices[kmax].order()].z() > zmax)) {
-          kmax--;
-        }
-      }
+      double zrange     = std::max(cParams.zrange()/ sqrt((_beta) * tracks.oneoverdz2(itrack)), zrange_min_);
+      // Binary search of both ends of the window: the first vertex above z - zrange and the last one below z + zrange, clamped to the list as the linear walk did
+      int kmin = base + std::min(lowerBound(orderedZ, nV, tracks.z(itrack) - zrange), nV - 1);
+      int kmax = base + std::max(lowerBound(orderedZ, nV, tracks.z(itrack) + zrange) - 1, 0);
       if (kmin <= kmax){ // i.e. we have vertex associated to the track
-        tracks[itrack].kmin() = (int) kmin;
-	tracks[itrack].kmax() = (int) kmax;
+        tracks.kmin(itrack) = (int) kmin;
+	tracks.kmax(itrack) = (int) kmax + 1;
       }
       else { // Otherwise, track goes in the most extreme vertex
-        tracks[itrack].kmin() = (int) std::max(maxVerticesPerBlock * blockIdx, (int) std::min(kmin, kmax));
-        tracks[itrack].kmax() = (int) std::min((maxVerticesPerBlock * blockIdx) + (int) vertices[blockIdx].nV(), (int) std::max(kmin, kmax) + 1);
+        tracks.kmin(itrack) = (int) std::max(base, (int) std::min(kmin, kmax));
+        tracks.kmax(itrack) = (int) std::min(base + nV, (int) std::max(kmin, kmax) + 1);
       }
     } //end for
     alpaka::syncBlockThreads(acc);
   }
 
-  template <bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void update(const TAcc& acc, portablevertex::TrackDeviceCollection::View tracks, portablevertex::VertexDeviceCollection::View vertices, const portablevertex::ClusterParamsHostCollection::ConstView cParams, double& osumtkwt, double& _beta, double rho0, bool updateTc){
+  ALPAKA_FN_ACC static int firstAtLeast(const int32_t* values, int n, int32_t value){
+    // Binary search in a non-decreasing array: first entry with values[i] >= value, n if there is none
+    int low = 0;
+    int high = n;
+    while (low < high){
+      int mid = (low + high) / 2;
+      if (values[mid] < value) low = mid + 1;
+      else high = mid;
+    }
+    return low;
+  }
+
+  template <typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void setTrackSpans(const TAcc& acc, const blockTracks tracks, const clusterizerWorkspace ws, int nV){
+    // For each position of the ordered vertex list, find a span of tracks out of which no [kmin, kmax) window contains it, so that the sums over tracks can be done per vertex over a short span
+    // The running maximum of kmax and the running minimum of kmin from the end do not decrease along the z-sorted tracks, so both ends of each span are binary searches in them
+    // The windows themselves are almost monotone, so the span is not much larger than the set of tracks that actually contribute
+    int blockSize = ws.blockSize; // Tracks per block
+    int nThreads  = alpaka::getWorkDiv<alpaka::Block, alpaka::Threads>(acc)[0u]; // Threads per block, 1 on the CPU backends
+    int threadIdx = alpaka::getIdx<alpaka::Block, alpaka::Threads>(acc)[0u]; // Thread number inside block
+    int blockIdx  = alpaka::getIdx<alpaka::Grid, alpaka::Blocks>(acc)[0u]; // Block number inside grid
+    int maxVerticesPerBlock = ws.maxVerticesPerBlock; // Capacity of the ordered vertex list of each block
+    int firstSlot = blockIdx * blockSize;
+    int32_t* kmaxPrefix = ws.trackKmaxPrefix + firstSlot;
+    int32_t* kminSuffix = ws.trackKminSuffix + firstSlot; // -kmin in reverse order, so its running maximum is the running minimum of kmin from the end
+    alpaka::syncBlockThreads(acc); // The windows might just have been written by other threads
+    for (int i = threadIdx; i < blockSize; i += nThreads){
+      kmaxPrefix[i] = tracks.kmax(firstSlot + i);
+      kminSuffix[i] = -tracks.kmin(firstSlot + blockSize - 1 - i);
+    }
+    alpaka::syncBlockThreads(acc);
+    blockInclusiveMaxScan(acc, *ws.scratch, kmaxPrefix, blockSize);
+    blockInclusiveMaxScan(acc, *ws.scratch, kminSuffix, blockSize);
+    for (int ivertexO = maxVerticesPerBlock * blockIdx + threadIdx; ivertexO < maxVerticesPerBlock * blockIdx + nV ; ivertexO += nThreads){
+      ws.firstTrack[ivertexO] = firstSlot + firstAtLeast(kmaxPrefix, blockSize, ivertexO + 1); // Tracks before it all have kmax <= ivertexO
+      ws.lastTrack[ivertexO]  = firstSlot + blockSize - 1 - firstAtLeast(kminSuffix, blockSize, -ivertexO); // Tracks after it all have kmin > ivertexO
+    }
+    alpaka::syncBlockThreads(acc);
+  }
+
+  template <int nTerms, typename TAcc, typename TSelected, typename TTerms> ALPAKA_FN_ACC static void sumOverSpans(const TAcc& acc, const blockTracks tracks, const clusterizerWorkspace ws, int nV, const TSelected& selected, const TTerms& terms){
+    // Per-vertex sums over the tracks of the spans set by setTrackSpans, for the list positions k with selected(k). terms(ivertexO, itrack, t) fills the nTerms contributions of a track whose window contains the position
+    // The (vertex, track) pairs of all spans are laid out one after the other and the whole block goes through them nThreads at a time, with a segmented sum per vertex, so a vertex with many tracks does not keep a single thread busy
+    // The combination order only depends on the pair index, so the sums are reproducible. They end up in ws.spanSums[maxSpanTerms*ivertexO + j]
+    int nThreads  = alpaka::getWorkDiv<alpaka::Block, alpaka::Threads>(acc)[0u]; // Threads per block, 1 on the CPU backends
+    int threadIdx = alpaka::getIdx<alpaka::Block, alpaka::Threads>(acc)[0u]; // Thread number inside block
+    int blockIdx  = alpaka::getIdx<alpaka::Grid, alpaka::Blocks>(acc)[0u]; // Block number inside grid
+    int maxVerticesPerBlock = ws.maxVerticesPerBlock; // Capacity of the ordered vertex list of each block
+    int base = maxVerticesPerBlock * blockIdx; // First position of the ordered list of this block
+    int32_t* spanOffset = ws.spanOffset + (maxVerticesPerBlock + 1) * blockIdx;
+    double* sums = ws.spanSums + maxSpanTerms * base;
+    for (int k = threadIdx; k < nV ; k += nThreads){
+      spanOffset[k] = selected(k) ? std::max(0, ws.lastTrack[base + k] - ws.firstTrack[base + k] + 1) : 0;
+      for (int j = 0; j < nTerms; j++) sums[maxSpanTerms*k + j] = 0.;
+    }
+    if (threadIdx == 0) spanOffset[nV] = 0;
+    alpaka::syncBlockThreads(acc);
+    int nPairs = blockExclusiveScan(acc, *ws.scratch, spanOffset, nV + 1);
+    for (int first = 0; first < nPairs; first += nThreads){ // Same number of rounds for all threads, as the segmented sums are collective
+      int pair = first + threadIdx;
+      int k = nV; // Threads past the last pair form a segment of their own
+      double t[nTerms];
+      for (int j = 0; j < nTerms; j++) t[j] = 0.;
+      if (pair < nPairs){
+        k = firstAtLeast(spanOffset, nV, pair + 1) - 1; // Last position whose pairs start at or before this one, empty spans are skipped
+        int ivertexO = base + k;
+        int itrack = ws.firstTrack[ivertexO] + pair - spanOffset[k];
+        if ((tracks.kmin(itrack) <= ivertexO) && (ivertexO < tracks.kmax(itrack))) terms(ivertexO, itrack, t); // Within the span, but maybe not in the window of this track
+      }
+      for (int j = 0; j < nTerms; j++){
+        bool last;
+        double partial = blockSegmentedSum(acc, *ws.scratch, t[j], k, last);
+        if (last && (k < nV)) sums[maxSpanTerms*k + j] += partial; // A single thread per vertex and round, the rounds are ordered by the syncs of the segmented sums
+      }
+    }
+    alpaka::syncBlockThreads(acc);
+  }
+
+  template <typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void removeFlaggedVertices(const TAcc& acc, const blockTracks tracks, portablevertex::VertexDeviceCollection::View vertices, const clusterizerWorkspace ws){
+    // Take out of the ordered list of the block all positions whose ws.positionMap flag is 0, in one parallel pass instead of shifting the list once per removed vertex
+    // The removed slots go back to the block free list, which cannot overflow as a block never holds more slots than fit in its ordered list
+    int blockSize = ws.blockSize; // Tracks per block
+    int nThreads  = alpaka::getWorkDiv<alpaka::Block, alpaka::Threads>(acc)[0u]; // Threads per block, 1 on the CPU backends
+    int threadIdx = alpaka::getIdx<alpaka::Block, alpaka::Threads>(acc)[0u]; // Thread number inside block
+    int blockIdx  = alpaka::getIdx<alpaka::Grid, alpaka::Blocks>(acc)[0u]; // Block number inside grid
+    int maxVerticesPerBlock = ws.maxVerticesPerBlock; // Capacity of the ordered vertex list of each block
+    int base = maxVerticesPerBlock * blockIdx; // First position of the ordered list of this block
+    int nV = vertices[blockIdx].nV();
+    int32_t nFree = ws.nFreeSlots[blockIdx];
+    int32_t* newPosition = ws.positionMap + (maxVerticesPerBlock + 1) * blockIdx; // Keep flags on input, new positions after the compaction
+    int32_t nKept = blockCompact(acc, *ws.scratch, ws.order + base, newPosition, ws.orderScratch + base, nV, ws.freeSlots + base + nFree);
+    for (int islot = threadIdx; islot < nV - nKept; islot += nThreads){
+      vertices[ws.freeSlots[base + nFree + islot]].isGood() = false;
+    }
+    // Move the track windows along: [kmin, kmax) now starts and ends at the new position of the first kept vertex at or after each bound
+    for (int itrack = threadIdx+blockIdx*blockSize; itrack < (blockIdx+1)*blockSize ; itrack += nThreads){
+      int kmin = base + newPosition[std::min(tracks.kmin(itrack), base + nV) - base];
+      int kmax = base + newPosition[std::min(tracks.kmax(itrack), base + nV) - base];
+      if ((kmax <= kmin) && (kmin > base)) kmin--; // All the vertices of the window are gone, fall back to the one just below
+      tracks.kmin(itrack) = kmin;
+      tracks.kmax(itrack) = kmax;
+    }
+    alpaka::syncBlockThreads(acc);
+    if (once_per_block(acc)){
+      ws.nFreeSlots[blockIdx] = nFree + nV - nKept;
+      vertices[blockIdx].nV() = nKept; // Also update nvertex
+    }
+    alpaka::syncBlockThreads(acc);
+    refreshOrderedZ(acc, vertices, ws);
+  }
+
+  template <bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void update(const TAcc& acc, const blockTracks tracks, portablevertex::VertexDeviceCollection::View vertices, const ClusterParamsCollection::ConstView cParams, const clusterizerWorkspace ws, double& osumtkwt, double& _beta, double rho0, bool updateTc){
     // Main function that updates the annealing parameters on each T step, computes all partition functions and so on
-    int blockSize = alpaka::getWorkDiv<alpaka::Grid, alpaka::Blocks>(acc)[0u];
+    int blockSize = ws.blockSize; // Tracks per block
+    int nThreads  = alpaka::getWorkDiv<alpaka::Block, alpaka::Threads>(acc)[0u]; // Threads per block, 1 on the CPU backends
     int threadIdx = alpaka::getIdx<alpaka::Block, alpaka::Threads>(acc)[0u]; // Thread number inside block
     int blockIdx  = alpaka::getIdx<alpaka::Grid, alpaka::Blocks>(acc)[0u]; // Block number inside grid
-    int maxVerticesPerBlock = (int) 512/blockSize; // Max vertices size is 512 over number of blocks in grid
+    int maxVerticesPerBlock = ws.maxVerticesPerBlock; // Capacity of the ordered vertex list of each block
     double Zinit =  rho0 * exp(-(_beta) * cParams.dzCutOff() * cParams.dzCutOff()); // Initial partition function, really only used on the outlier rejection step to penalize
-    for (int itrack = threadIdx+blockIdx*blockSize; itrack < threadIdx+(blockIdx+1)*blockSize ; itrack += blockSize){
-      double botrack_dz2 = -(_beta) * tracks[itrack].oneoverdz2();
-      tracks[itrack].sum_Z() = Zinit;
-      for (int ivertexO = tracks[itrack].kmin(); ivertexO < tracks[itrack].kmax() ; ++ivertexO){
-        int ivertex = vertices[ivertexO].order(); // Remember to always take ordering from here when dealing with vertices
-	double mult_res = tracks[itrack].z() - vertices[ivertex].z();
-	tracks[itrack].vert_exparg()[ivertex] = botrack_dz2*mult_res*mult_res; // -beta*(z_t-z_v)/dz^2
-	tracks[itrack].vert_exp()[ivertex]    = exp(tracks[itrack].vert_exparg()[ivertex] ); // e^{-beta*(z_t-z_v)/dz^2}
-        tracks[itrack].sum_Z()      += vertices[ivertex].rho()*tracks[itrack].vert_exp()[ivertex]; // Z_t = sum_v pho_v * e^{-beta*(z_t-z_v)/dz^2}, partition function of the track
-      } //end vertex for
-      if(not(std::isfinite(tracks[itrack].sum_Z()))) tracks[itrack].sum_Z() = 0; // Just in case something diverges
-      if(tracks[itrack].sum_Z()>1e-100){ // If non-zero then the track has a non-trivial assignment to a vertex
-        double sumw = tracks[itrack].weight()/tracks[itrack].sum_Z();
-  	for (int ivertexO = tracks[itrack].kmin(); ivertexO < tracks[itrack].kmax() ; ++ivertexO){
-          int ivertex = vertices[ivertexO].order(); // Remember to always take ordering from here when dealing with vertices
-          tracks[itrack].vert_se()[ivertex] = tracks[itrack].vert_exp()[ivertex] * sumw; // From partition of track to contribution of track to vertex partition
-          double w = vertices[ivertex].rho() * tracks[itrack].vert_exp()[ivertex] * sumw * tracks[itrack].oneoverdz2(); 
-          tracks[itrack].vert_sw()[ivertex]  = w; // Contribution of track to vertex as weight
-          tracks[itrack].vert_swz()[ivertex] = w * tracks[itrack].z(); // Weighted track position
-          if (updateTc){ 
-	    tracks[itrack].vert_swE()[ivertex] = -w * tracks[itrack].vert_exparg()[ivertex]/(_beta); // Only need it when changing the Tc (i.e. after a split), to recompute it
-	  }
-	  else{
-	    tracks[itrack].vert_swE()[ivertex] = 0;
+    // The track-vertex terms only exist in the [kmin, kmax) window, so each track stores them contiguously in its own slice of the block storage
+    // The slices are laid out by a scan of the window sizes, so they stay in place from one call to the next as long as the windows do not change
+    for (int itrack = threadIdx+blockIdx*blockSize; itrack < (blockIdx+1)*blockSize ; itrack += nThreads){
+      ws.trackVertexOffset[itrack] = tracks.kmax(itrack) - tracks.kmin(itrack);
+    }
+    alpaka::syncBlockThreads(acc);
+    blockExclusiveScan(acc, *ws.scratch, ws.trackVertexOffset + blockIdx*blockSize, blockSize);
+    // First the partition function of each track, one thread per track
+    for (int itrack = threadIdx+blockIdx*blockSize; itrack < (blockIdx+1)*blockSize ; itrack += nThreads){
+      double botrack_dz2 = -(_beta) * tracks.oneoverdz2(itrack);
+      int kmin = tracks.kmin(itrack);
+      int kmax = tracks.kmax(itrack);
+      int32_t offset = ws.trackVertexOffset[itrack];
+      if (offset + kmax - kmin > ws.trackVertexCapacity) offset = -1; // If the block storage is full, the exponentials are just recomputed
+      ws.trackVertexOffset[itrack] = offset;
+      double sum_Z = Zinit;
+      for (int ivertexO = kmin; ivertexO < kmax ; ++ivertexO){
+        int ivertex = ws.order[ivertexO]; // Remember to always take ordering from here when dealing with vertices
+	double mult_res = tracks.z(itrack) - ws.orderedZ[ivertexO - maxVerticesPerBlock * blockIdx];
+	double v_exparg = botrack_dz2*mult_res*mult_res; // -beta*(z_t-z_v)/dz^2
+	double v_exp;
+	if (offset >= 0){
+	  // Most vertices barely move in the late iterations, and beta does not change within thermalize, so the stored term is reused if its exponent is close enough to the current one
+	  // The stored exponent is checked rather than the vertex movement, so the reuse stays safe across merges, splits and beta changes, and the relative error of each term is bounded by expCacheTolerance
+	  // With no tolerance the exponents are not compared at all, the term is recomputed and only stored for the second pass below
+	  int32_t icache = ws.trackVertexCapacity * blockIdx + offset + ivertexO - kmin;
+	  if (ws.expCacheTolerance > 0 and abs(v_exparg - ws.trackVertexArg[icache]) <= ws.expCacheTolerance) v_exp = ws.trackVertexExp[icache]; // Also false for the NaN set by initialize
+	  else {
+	    v_exp = exp(v_exparg); // e^{-beta*(z_t-z_v)/dz^2}
+	    ws.trackVertexExp[icache] = v_exp;
+	    if (ws.expCacheTolerance > 0) ws.trackVertexArg[icache] = v_exparg;
 	  }
-        } //end vertex for
-      } //end if
+	}
+	else v_exp = exp(v_exparg);
+        sum_Z += vertices[ivertex].rho()*v_exp; // Z_t = sum_v pho_v * e^{-beta*(z_t-z_v)/dz^2}, partition function of the track. rho changes on every call, so this sum is always redone
+      } //end vertex for
+      if(not(std::isfinite(sum_Z))) sum_Z = 0; // Just in case something diverges
+      tracks.sum_Z(itrack) = sum_Z;
     } //end track for
-    alpaka::syncBlockThreads(acc);
-    // After the track-vertex matrix assignment, we need to add up across vertices. This time, we use one thread per vertex
-    for (int ivertexO = maxVerticesPerBlock * blockIdx + threadIdx; ivertexO < maxVerticesPerBlock * blockIdx + vertices[blockIdx].nV() ; ivertexO += blockSize){
-      vertices[ivertexO].se() = 0.;
-      vertices[ivertexO].sw() = 0.;
-      vertices[ivertexO].swz() = 0.;
-      vertices[ivertexO].aux1() = 0.;
-      if (updateTc) vertices[ivertexO].swE() = 0.;
-    } // end vertex for
-    for (int itrack = threadIdx+blockIdx*blockSize; itrack < threadIdx+(blockIdx+1)*blockSize ; itrack += blockSize){
-      for (int ivertexO = tracks[itrack].kmin(); ivertexO < tracks[itrack].kmax() ; ++ivertexO){
-	// TODO: these atomics are going to be very slow. Can we optimize?
-        int ivertex = vertices[ivertexO].order(); // Remember to always take ordering from here when dealing with vertices
-        alpaka::atomicAdd(acc, &vertices[ivertex].se(), tracks[itrack].vert_se()[ivertex], alpaka::hierarchy::Threads{});
-        alpaka::atomicAdd(acc, &vertices[ivertex].sw(), tracks[itrack].vert_sw()[ivertex], alpaka::hierarchy::Threads{});
-        alpaka::atomicAdd(acc, &vertices[ivertex].swz(), tracks[itrack].vert_swz()[ivertex], alpaka::hierarchy::Threads{});
-        if (updateTc) alpaka::atomicAdd(acc, &vertices[ivertex].swE(), tracks[itrack].vert_swE()[ivertex], alpaka::hierarchy::Threads{});
-      } // end for
-    }
-    alpaka::syncBlockThreads(acc);
-    // Last, evalute vertex properties
-    for (int ivertexO = maxVerticesPerBlock * blockIdx + threadIdx; ivertexO < maxVerticesPerBlock * blockIdx + vertices[blockIdx].nV() ; ivertexO += blockSize){
-      int ivertex = vertices[ivertexO].order(); // Remember to always take ordering from here when dealing with vertices
-      if (vertices[ivertex].sw() > 0){ // If any tracks were assigned, update
-        double znew = vertices[ivertex].swz()/vertices[ivertex].sw();
-	vertices[ivertex].aux1() = abs(znew - vertices[ivertex].z()); // How much the vertex moved which we need to determine convergence in thermalize
+    int nV = vertices[blockIdx].nV();
+    setTrackSpans(acc, tracks, ws, nV); // Also syncs, so all partition functions are ready
+    // Then add up across tracks, with the whole block going through the (vertex, track) pairs. The sums are reproducible and without atomics
+    sumOverSpans<4>(acc, tracks, ws, nV, [](int){ return true; }, [&](int ivertexO, int itrack, double (&t)[4]){
+      if (not(tracks.sum_Z(itrack) > 1e-100)) return; // The track has no non-trivial assignment to a vertex
+      int ivertex = ws.order[ivertexO]; // Remember to always take ordering from here when dealing with vertices
+      double sumw = tracks.weight(itrack)/tracks.sum_Z(itrack);
+      double mult_res = tracks.z(itrack) - ws.orderedZ[ivertexO - maxVerticesPerBlock * blockIdx];
+      double v_exparg = -(_beta) * tracks.oneoverdz2(itrack) * mult_res*mult_res; // -beta*(z_t-z_v)/dz^2
+      int32_t offset = ws.trackVertexOffset[itrack];
+      double v_exp = offset >= 0 ? ws.trackVertexExp[ws.trackVertexCapacity * blockIdx + offset + ivertexO - tracks.kmin(itrack)] : exp(v_exparg);
+      double w = vertices[ivertex].rho() * v_exp * sumw * tracks.oneoverdz2(itrack); // Contribution of track to vertex as weight
+      t[0] = v_exp * sumw; // From partition of track to contribution of track to vertex partition
+      t[1] = w;
+      t[2] = w * tracks.z(itrack); // Weighted track position
+      t[3] = -w * v_exparg/(_beta); // Only needed when changing the Tc (i.e. after a split), to recompute it
+    });
+    // Every thread only reads and writes its own vertex, so the vertex properties can be updated right away
+    for (int ivertexO = maxVerticesPerBlock * blockIdx + threadIdx; ivertexO < maxVerticesPerBlock * blockIdx + nV ; ivertexO += nThreads){
+      int ivertex = ws.order[ivertexO]; // Remember to always take ordering from here when dealing with vertices
+      double zv = ws.orderedZ[ivertexO - maxVerticesPerBlock * blockIdx];
+      double se  = ws.spanSums[maxSpanTerms*ivertexO];
+      double sw  = ws.spanSums[maxSpanTerms*ivertexO + 1];
+      double swz = ws.spanSums[maxSpanTerms*ivertexO + 2];
+      double swE = ws.spanSums[maxSpanTerms*ivertexO + 3];
+      vertices[ivertex].se()  = se;
+      vertices[ivertex].sw()  = sw;
+      vertices[ivertex].swz() = swz;
+      if (updateTc) vertices[ivertex].swE() = swE;
+      // Last, evalute vertex properties
+      vertices[ivertex].aux1() = 0.;
+      if (sw > 0){ // If any tracks were assigned, update
+        double znew = swz/sw;
+	vertices[ivertex].aux1() = abs(znew - zv); // How much the vertex moved which we need to determine convergence in thermalize
 	vertices[ivertex].z() = znew;
+	ws.orderedZ[ivertexO - maxVerticesPerBlock * blockIdx] = znew; // Keep the dense copy current, this thread owns the position
       }
-      vertices[ivertex].rho() = vertices[ivertex].rho()*vertices[ivertex].se()*osumtkwt; // This is the 'size' or 'mass' of the vertex  
+      vertices[ivertex].rho() = vertices[ivertex].rho()*se*osumtkwt; // This is the 'size' or 'mass' of the vertex
     } // end vertex for
     alpaka::syncBlockThreads(acc);
   } //end update
 
-  template <bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void merge(const TAcc& acc, portablevertex::TrackDeviceCollection::View tracks, portablevertex::VertexDeviceCollection::View vertices, const portablevertex::ClusterParamsHostCollection::ConstView cParams, double& osumtkwt, double& _beta){
-    // If two vertex are too close together, merge them
-    int blockSize = alpaka::getWorkDiv<alpaka::Grid, alpaka::Blocks>(acc)[0u];
+  ALPAKA_FN_ACC static bool isMergeSelected(const double* orderedZ, int nV, int k, double zmerge){
+    // The pair at positions (k, k+1) is merged in this call if it is closer than zmerge and than the neighbouring pairs that are also closer than zmerge, ties going to the lower position
+    // Selected pairs never share a vertex, and they are the ones merging the closest pair first, one at a time, would take first
+    double dist = abs(orderedZ[k+1] - orderedZ[k]);
+    if (not(dist < zmerge)) return false;
+    if (k > 0){
+      double distPrev = abs(orderedZ[k] - orderedZ[k-1]);
+      if ((distPrev < zmerge) && (distPrev <= dist)) return false;
+    }
+    if (k < nV - 2){
+      double distNext = abs(orderedZ[k+2] - orderedZ[k+1]);
+      if ((distNext < zmerge) && (distNext < dist)) return false;
+    }
+    return true;
+  }
+
+  template <bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void merge(const TAcc& acc, const blockTracks tracks, portablevertex::VertexDeviceCollection::View vertices, const ClusterParamsCollection::ConstView cParams, const clusterizerWorkspace ws, double& osumtkwt, double& _beta){
+    // If two vertex are too close together, merge them. All the pairs that do not conflict are merged in one go, each thread looking at its own positions
+    int nThreads  = alpaka::getWorkDiv<alpaka::Block, alpaka::Threads>(acc)[0u]; // Threads per block, 1 on the CPU backends
     int threadIdx = alpaka::getIdx<alpaka::Block, alpaka::Threads>(acc)[0u]; // Thread number inside block
     int blockIdx  = alpaka::getIdx<alpaka::Grid, alpaka::Blocks>(acc)[0u]; // Block number inside grid
-    int maxVerticesPerBlock = (int) 512/blockSize; // Max vertices size is 512 over number of blocks in grid
+    int maxVerticesPerBlock = ws.maxVerticesPerBlock; // Capacity of the ordered vertex list of each block
+    int base = maxVerticesPerBlock * blockIdx; // First position of the ordered list of this block
     int nprev = vertices[blockIdx].nV();
     if (nprev < 2) return;
-    for (int ivertexO = maxVerticesPerBlock * blockIdx + threadIdx; ivertexO < maxVerticesPerBlock * blockIdx + vertices[blockIdx].nV() ; ivertexO += blockSize){
-      int ivertex = vertices[ivertexO].order();
-      int ivertexnext = vertices[ivertexO+1].order();
-      vertices[ivertex].aux1() = abs(vertices[ivertex].z() - vertices[ivertexnext].z());
+    int32_t* keep = ws.positionMap + (maxVerticesPerBlock + 1) * blockIdx;
+    double nMerged = 0.;
+    for (int k = threadIdx; k < nprev ; k += nThreads){
+      bool merged = (k < nprev - 1) && isMergeSelected(ws.orderedZ, nprev, k, cParams.zmerge());
+      keep[k] = merged ? 0 : 1; // The lower vertex of the pair goes away
+      if (not merged) continue;
+      int ivertex     = ws.order[base + k];  // This will be merged into the next one
+      int ivertexnext = ws.order[base + k + 1]; // Only this thread touches it, selected pairs do not share vertices
+      double rho =  vertices[ivertex].rho() + vertices[ivertexnext].rho();
+      if (rho > 1.e-100){ 
+        vertices[ivertexnext].z() = (vertices[ivertex].rho() * vertices[ivertex].z() + vertices[ivertexnext].rho() * vertices[ivertexnext].z()) / rho;
+      } 
+      else{
+        vertices[ivertexnext].z() = 0.5 * (vertices[ivertex].z() + vertices[ivertexnext].z());
+      } 
+      vertices[ivertexnext].rho()  = rho;
+      vertices[ivertexnext].sw()  += vertices[ivertex].sw();
+      nMerged += 1.;
     }
-    alpaka::syncBlockThreads(acc);
-    // Sorter things
-    auto& critical_dist = alpaka::declareSharedVar<float[128], __COUNTER__>(acc);
-    auto& critical_index = alpaka::declareSharedVar<float[128], __COUNTER__>(acc);
-    int& ncritical = alpaka::declareSharedVar<int, __COUNTER__>(acc);
+    nMerged = blockSum(acc, *ws.scratch, nMerged); // Also syncs, so the keep flags are complete
+    if (nMerged == 0) return; // Nothing close enough
+    removeFlaggedVertices(acc, tracks, vertices, ws);
+    set_vtx_range(acc, tracks, vertices, cParams, ws, osumtkwt, _beta);
+  }
 
-    if (once_per_block(acc)){
-      ncritical = 0;
-      for (int ivertexO = maxVerticesPerBlock * blockIdx + threadIdx; ivertexO < maxVerticesPerBlock * blockIdx + vertices[blockIdx].nV() ; ivertexO += blockSize){
-        int ivertex = vertices[ivertexO].order();
-        if (vertices[ivertex].aux1() < cParams.zmerge()){ // i.e., if we are to split the vertex
-          critical_dist[ncritical] = abs(vertices[ivertex].aux1());
-          critical_index[ncritical] = ivertexO;
-          ncritical++;
-          if (ncritical > 128) break;
-        }
-      }
-    } // end once_per_block
-    alpaka::syncBlockThreads(acc);
-    if (ncritical == 0) return;
-    for (int sortO = 0; sortO < ncritical ; ++sortO){ // All threads are running the same code, to know where to exit, which is clunky
-      if (ncritical == 0 || maxVerticesPerBlock == nprev) return;
-      int ikO = 0;
-      double minVal = 999999.;
-      for (int sort1 = 0; sort1 < ncritical; ++sort1){
-        if (critical_dist[sort1] > minVal){
-          minVal = critical_dist[sort1];
-          ikO    = sort1;
-        }
-      }
-      critical_dist[ikO] = 9999999.;
-      int ivertexO    = critical_index[ikO];
-      int ivertex     = vertices[ivertexO].order();  // This will be splitted
-      int ivertexnext = blockIdx * maxVerticesPerBlock + nprev -1;
-      // A little bit of safety here. First is needed to avoid reading the -1 entry of vertices->order. Second is not as far as we don't go over 511 vertices, but better keep it just in case
-      if (ivertexO < blockIdx * maxVerticesPerBlock + nprev -1) ivertexnext = vertices[ivertexO+1].order();  // This will be used in a couple of computations
-      alpaka::syncBlockThreads(acc);
-      if (once_per_block(acc)){ // Really no way of parallelizing this I'm afraid
-        vertices[ivertex].isGood() = false; // Delete it!
-        double rho =  vertices[ivertex].rho() + vertices[ivertexnext].rho();
-        if (rho > 1.e-100){ 
-          vertices[ivertexnext].z() = (vertices[ivertex].rho() * vertices[ivertex].z() + vertices[ivertexnext].rho() * vertices[ivertexnext].z()) / rho;
-        } 
-        else{
-          vertices[ivertexnext].z() = 0.5 * (vertices[ivertex].z() + vertices[ivertexnext].z());
-        } 
-        vertices[ivertexnext].rho()  = rho;
-        vertices[ivertexnext].sw()  += vertices[ivertex].sw();
-        for (int ivertexOO = ivertexO ; ivertexOO < maxVerticesPerBlock * blockIdx + nprev -1 ; ++ivertexOO){
-          vertices[ivertexOO].order() = vertices[ivertexOO+1].order();
-        }
-        vertices[blockIdx].nV() = vertices[blockIdx].nV()-1; // Also update nvertex
-      } // end once_per_block
-      alpaka::syncBlockThreads(acc); 
-      for (int resort = 0; resort < ncritical ; ++resort){
-        if (critical_index[resort] > ivertexO) critical_index[resort]--; // critical_index refers to the original vertices->order, so it needs to be updated 
-      }
-      nprev = vertices[blockIdx].nV(); // And to the counter of previous vertices
-      for (int itrack = threadIdx+blockIdx*blockSize; itrack < threadIdx+(blockIdx+1)*blockSize ; itrack += blockSize){
-        if (tracks[itrack].kmax() > ivertexO) tracks[itrack].kmax()--;
-        if ((tracks[itrack].kmin() > ivertexO) || ((tracks[itrack].kmax() < (tracks[itrack].kmin() + 1)) && (tracks[itrack].kmin() > maxVerticesPerBlock*blockIdx))) tracks[itrack].kmin()--;
-      }
-      alpaka::syncBlockThreads(acc);
-      set_vtx_range(acc, tracks, vertices, cParams, osumtkwt, _beta);
-      return; 
+  ALPAKA_FN_ACC static bool isSplitSelected(portablevertex::VertexDeviceCollection::View vertices, const clusterizerWorkspace ws, int base, int nV, int k, double _beta, double threshold){
+    // The vertex at position k is split in this round if its critical temperature (aux1) is reached and above the one of the neighbours that are also waiting, ties going to the lower position
+    // Splits only look at their immediate neighbours, so this gives the same result as going one at a time from the highest temperature down
+    double Tc = vertices[ws.order[base + k]].aux1();
+    if (not(Tc * _beta > threshold)) return false;
+    if (k > 0){
+      double TcPrev = vertices[ws.order[base + k - 1]].aux1();
+      if ((TcPrev * _beta > threshold) && (TcPrev >= Tc)) return false;
     }
-    alpaka::syncBlockThreads(acc);
-    set_vtx_range(acc, tracks, vertices, cParams, osumtkwt, _beta);
-    alpaka::syncBlockThreads(acc);
+    if (k < nV - 1){
+      double TcNext = vertices[ws.order[base + k + 1]].aux1();
+      if ((TcNext * _beta > threshold) && (TcNext > Tc)) return false;
+    }
+    return true;
   }
 
-  template <bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void split(const TAcc& acc, portablevertex::TrackDeviceCollection::View tracks, portablevertex::VertexDeviceCollection::View vertices, const portablevertex::ClusterParamsHostCollection::ConstView cParams, double& osumtkwt, double& _beta, double threshold){
-    int blockSize = alpaka::getWorkDiv<alpaka::Grid, alpaka::Blocks>(acc)[0u];
+  template <bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void split(const TAcc& acc, const blockTracks tracks, portablevertex::VertexDeviceCollection::View vertices, const ClusterParamsCollection::ConstView cParams, const clusterizerWorkspace ws, double& osumtkwt, double& _beta, double threshold){
+    // Split the vertices that reached their critical temperature. This goes in rounds, each round splitting at once all the waiting vertices that do not conflict with each other
+    int blockSize = ws.blockSize; // Tracks per block
+    int nThreads  = alpaka::getWorkDiv<alpaka::Block, alpaka::Threads>(acc)[0u]; // Threads per block, 1 on the CPU backends
     int threadIdx = alpaka::getIdx<alpaka::Block, alpaka::Threads>(acc)[0u]; // Thread number inside block
     int blockIdx  = alpaka::getIdx<alpaka::Grid, alpaka::Blocks>(acc)[0u]; // Block number inside grid
-    int maxVerticesPerBlock = (int) 512/blockSize; // Max vertices size is 512 over number of blocks in grid
-    update(acc, tracks, vertices, cParams, osumtkwt, _beta, 0.0, false); // Update positions after merge
+    int maxVerticesPerBlock = ws.maxVerticesPerBlock; // Capacity of the ordered vertex list of each block
+    update(acc, tracks, vertices, cParams, ws, osumtkwt, _beta, 0.0, true); // Update positions after merge, also getting the swE sums the critical temperatures need
     alpaka::syncBlockThreads(acc);
     double epsilon = 1e-3;
-    int nprev = vertices[blockIdx].nV();
+    int base = maxVerticesPerBlock * blockIdx; // First position of the ordered list of this block
     // Set critical T for all vertices
-    for (int ivertexO = maxVerticesPerBlock * blockIdx + threadIdx; ivertexO < maxVerticesPerBlock * blockIdx + vertices[blockIdx].nV() ; ivertexO += blockSize){
-      int ivertex = vertices[ivertexO].order(); // Remember to always take ordering from here when dealing with vertices
+    for (int ivertexO = maxVerticesPerBlock * blockIdx + threadIdx; ivertexO < maxVerticesPerBlock * blockIdx + vertices[blockIdx].nV() ; ivertexO += nThreads){
+      int ivertex = ws.order[ivertexO]; // Remember to always take ordering from here when dealing with vertices
       double Tc = 2 * vertices[ivertex].swE() / vertices[ivertex].sw();
       vertices[ivertex].aux1() = Tc;
     }
     alpaka::syncBlockThreads(acc);
-    // Sorter things
-    auto& critical_temp = alpaka::declareSharedVar<float[128], __COUNTER__>(acc);
-    auto& critical_index = alpaka::declareSharedVar<float[128], __COUNTER__>(acc);
-    int& ncritical = alpaka::declareSharedVar<int, __COUNTER__>(acc);
-    // Information for the vertex splitting properties
-    double& p1 = alpaka::declareSharedVar<double, __COUNTER__>(acc);
-    double& p2 = alpaka::declareSharedVar<double, __COUNTER__>(acc);
-    double& z1 = alpaka::declareSharedVar<double, __COUNTER__>(acc);
-    double& z2 = alpaka::declareSharedVar<double, __COUNTER__>(acc);
-    double& w1 = alpaka::declareSharedVar<double, __COUNTER__>(acc);
-    double& w2 = alpaka::declareSharedVar<double, __COUNTER__>(acc);
-
-    if (once_per_block(acc)){
-      ncritical = 0;
-      for (int ivertexO = maxVerticesPerBlock * blockIdx + threadIdx; ivertexO < maxVerticesPerBlock * blockIdx + vertices[blockIdx].nV() ; ivertexO += blockSize){
-        int ivertex = vertices[ivertexO].order();
-        if (vertices[ivertex].aux1() * _beta > threshold){ // i.e., if we are to split the vertex
-          critical_temp[ncritical] = abs(vertices[ivertex].aux1());
-	  critical_index[ncritical] = ivertexO;
-	  ncritical++;
-	  if (ncritical > 128) break;
-        }
+    int32_t* splitRank = ws.positionMap + (maxVerticesPerBlock + 1) * blockIdx; // Selection flags, then number of splits before each position
+    int32_t* newSlots  = ws.newSlots + base; // Slots of the new vertices of the round, by split rank
+    double* halves     = ws.splitHalves + 4 * base; // z and rho of the lower and upper halves, by position
+    int& nAllocated = alpaka::declareSharedVar<int, __COUNTER__>(acc);
+    while (true){
+      int nV = vertices[blockIdx].nV();
+      // Pick the vertices of this round
+      double nWaiting = 0.;
+      for (int k = threadIdx; k < nV ; k += nThreads){
+        if (vertices[ws.order[base + k]].aux1() * _beta > threshold) nWaiting += 1.; // i.e., if we are to split the vertex
+        splitRank[k] = isSplitSelected(vertices, ws, base, nV, k, _beta, threshold) ? 1 : 0;
       }
-    } // end once_per_block
-    alpaka::syncBlockThreads(acc);
-    if (ncritical == 0 || maxVerticesPerBlock == nprev) return;
-    for (int sortO = 0; sortO < ncritical ; ++sortO){ // All threads are running the same code, to know where to exit, which is clunky
-      if (ncritical == 0 || maxVerticesPerBlock == nprev) return;
-      int ikO = 0;
-      double maxVal = -1.;
-      for (int sort1 = 0; sort1 < ncritical; ++sort1){
-        if (critical_temp[sort1] > maxVal){
-          maxVal = critical_temp[sort1];
-          ikO    = sort1;
-        }
-      }
-      critical_temp[ikO] = -1.;
-      int ivertexO    = critical_index[ikO];
-      int ivertex     = vertices[ivertexO].order();  // This will be splitted
-      int ivertexprev = blockIdx * maxVerticesPerBlock;
-      int ivertexnext = blockIdx * maxVerticesPerBlock + nprev -1; 
-      // A little bit of safety here. First is needed to avoid reading the -1 entry of vertices->order. Second is not as far as we don't go over 511 vertices, but better keep it just in case
-      if (ivertexO > blockIdx * maxVerticesPerBlock) ivertexprev = vertices[ivertexO-1].order();  // This will be used in a couple of computations
-      if (ivertexO < blockIdx * maxVerticesPerBlock + nprev -1) ivertexnext = vertices[ivertexO+1].order();  // This will be used in a couple of computations
-      if (once_per_block(acc)){
-        p1 = 0.;
-	p2 = 0.;
-	z1 = 0.;
-	z2 = 0.;
-	w1 = 0.;
-	w2 = 0.;
-      }
-      alpaka::syncBlockThreads(acc);
-      for (int itrack = threadIdx+blockIdx*blockSize; itrack < threadIdx+(blockIdx+1)*blockSize ; itrack += blockSize){
-        if (tracks[itrack].sum_Z() > 1.e-100) {
-          // winner-takes-all, usually overestimates splitting
-          double tl = tracks[itrack].z() < vertices[ivertex].z() ? 1. : 0.;
-          double tr = 1. - tl;
-          // soften it, especially at low T
-          double arg = (tracks[itrack].z() - vertices[ivertex].z()) * sqrt((_beta) * tracks[itrack].oneoverdz2());
-          if (abs(arg) < 20) {
-            double t = exp(-arg);
-            tl = t / (t + 1.);
-            tr = 1 / (t + 1.);
-          }
-	  // Recompute split vertex quantities
-          double p = vertices[ivertex].rho() * tracks[itrack].weight() * exp(-(_beta) * (tracks[itrack].z()-vertices[ivertex].z())*(tracks[itrack].z()-vertices[ivertex].z())* tracks[itrack].oneoverdz2())/ tracks[itrack].sum_Z();
-          double w = p * tracks[itrack].oneoverdz2();
-	  alpaka::atomicAdd(acc, &p1, p*tl, alpaka::hierarchy::Threads{});
-	  alpaka::atomicAdd(acc, &p2, p*tr, alpaka::hierarchy::Threads{});
-	  alpaka::atomicAdd(acc, &z1, w*tl*tracks[itrack].z(), alpaka::hierarchy::Threads{});
-	  alpaka::atomicAdd(acc, &z2, p*tr*tracks[itrack].z(), alpaka::hierarchy::Threads{});
-	  alpaka::atomicAdd(acc, &w1, w*tl, alpaka::hierarchy::Threads{});
-	  alpaka::atomicAdd(acc, &w2, w*tr, alpaka::hierarchy::Threads{});
+      if (threadIdx == 0) splitRank[nV] = 0;
+      nWaiting = blockSum(acc, *ws.scratch, nWaiting); // Also syncs, so the selection is complete before aux1 changes
+      if (nWaiting == 0) break;
+      // Compute both halves of each picked vertex, summing over the tracks of their spans with the whole block
+      sumOverSpans<6>(acc, tracks, ws, nV, [&](int k){ return splitRank[k] != 0; }, [&](int ivertexO, int itrack, double (&t)[6]){
+        if (not(tracks.sum_Z(itrack) > 1.e-100)) return;
+        int ivertex = ws.order[ivertexO];
+        // winner-takes-all, usually overestimates splitting
+        double tl = tracks.z(itrack) < vertices[ivertex].z() ? 1. : 0.;
+        double tr = 1. - tl;
+        // soften it, especially at low T
+        double arg = (tracks.z(itrack) - vertices[ivertex].z()) * sqrt((_beta) * tracks.oneoverdz2(itrack));
+        if (abs(arg) < 20) {
+          double e = exp(-arg);
+          tl = e / (e + 1.);
+          tr = 1 / (e + 1.);
         }
-      }
-      alpaka::syncBlockThreads(acc);
-      if (once_per_block(acc)){
+        // Recompute split vertex quantities
+        double p = vertices[ivertex].rho() * tracks.weight(itrack) * exp(-(_beta) * (tracks.z(itrack)-vertices[ivertex].z())*(tracks.z(itrack)-vertices[ivertex].z())* tracks.oneoverdz2(itrack))/ tracks.sum_Z(itrack);
+        double w = p * tracks.oneoverdz2(itrack);
+        t[0] = p*tl;
+        t[1] = p*tr;
+        t[2] = w*tl*tracks.z(itrack);
+        t[3] = w*tr*tracks.z(itrack);
+        t[4] = w*tl;
+        t[5] = w*tr;
+      });
+      for (int k = threadIdx; k < nV ; k += nThreads){
+        if (splitRank[k] == 0) continue;
+        int ivertexO = base + k;
+        int ivertex  = ws.order[ivertexO];  // This will be splitted
+        double p1 = ws.spanSums[maxSpanTerms*ivertexO];
+        double p2 = ws.spanSums[maxSpanTerms*ivertexO + 1];
+        double z1 = ws.spanSums[maxSpanTerms*ivertexO + 2];
+        double z2 = ws.spanSums[maxSpanTerms*ivertexO + 3];
+        double w1 = ws.spanSums[maxSpanTerms*ivertexO + 4];
+        double w2 = ws.spanSums[maxSpanTerms*ivertexO + 5];
 	// If one vertex is taking all the things, then set the others slightly off to help splitting
-        if (w1 > 0){
-          z1 = z1/w1;
-	}
-        else{
-	  z1 = vertices[ivertex].z() - epsilon;	
-	}
-	if (w2 > 0){
-          z2 = z2/w2;
+        z1 = w1 > 0 ? z1/w1 : vertices[ivertex].z() - epsilon;
+        z2 = w2 > 0 ? z2/w2 : vertices[ivertex].z() + epsilon;
+        // If there is not enough room, reduce split size. Neighbours are not split in the same round, so their z is stable
+	if ((k > 0) && (z1 < (0.6 * vertices[ivertex].z() + 0.4 * ws.orderedZ[k-1]))) { // First in the if is the position, as we care on whether the vertex is the leftmost or rightmost
+          z1 = 0.6 * vertices[ivertex].z() + 0.4 * ws.orderedZ[k-1];
         }
-        else{
-          z2 = vertices[ivertex].z() + epsilon;
+        if ((k < nV - 1) && (z2 > (0.6 * vertices[ivertex].z() + 0.4 * ws.orderedZ[k+1]))) {
+          z2 = 0.6 * vertices[ivertex].z() + 0.4 * ws.orderedZ[k+1];
         }
-        // If there is not enough room, reduce split size
-	if ((ivertexO > maxVerticesPerBlock*blockIdx) && (z1 < (0.6 * vertices[ivertex].z() + 0.4 * vertices[ivertexprev].z()))) { // First in the if is ivertexO, as we care on whether the vertex is the leftmost or rightmost
-          z1 = 0.6 * vertices[ivertex].z() + 0.4 * vertices[ivertexprev].z();
+        vertices[ivertex].aux1() = 0.; // Done with this vertex for this call, whether it splits or not
+        if (abs(z2-z1) > epsilon){
+          halves[4*k]   = z1;
+          halves[4*k+1] = p1 * vertices[ivertex].rho() / (p1 + p2);
+          halves[4*k+2] = z2;
+          halves[4*k+3] = p2 * vertices[ivertex].rho() / (p1 + p2);
         }
-        if ((ivertexO < maxVerticesPerBlock* blockIdx +  nprev - 1) && (z2 > (0.6 * vertices[ivertex].z() + 0.4 * vertices[ivertexnext].z()))) {
-          z2 = 0.6 * vertices[ivertex].z() + 0.4 * vertices[ivertexnext].z();
-        }
-      } // end once_per_block
-      // Now save the properties of the new stuff
-      alpaka::syncBlockThreads(acc);
-      int nnew = 999999;
-      if (abs(z2-z2) > epsilon){ 
-        // Find the first empty index to save the vertex
-        for (int icheck = maxVerticesPerBlock * blockIdx ; icheck < maxVerticesPerBlock * (blockIdx + 1); icheck ++ ){
-          if (not(vertices[icheck].isGood())){
-            nnew = icheck;
-            break;
-          }
+        else{
+          splitRank[k] = 0; // If both halves ended up in the same place, there is nothing to split
         }
-        if (nnew == 999999) break;
       }
+      alpaka::syncBlockThreads(acc);
+      int nSplit = blockExclusiveScan(acc, *ws.scratch, splitRank, nV + 1);
+      if (nSplit == 0) continue;
+      // Get slots for the new vertices, as many as fit both in the ordered list and in the pool
       if (once_per_block(acc)){
-        double pk1 = p1 * vertices[ivertex].rho() / (p1 + p2);
-        double pk2 = p2 * vertices[ivertex].rho() / (p1 + p2);
-        vertices[ivertex].z() = z2;
-        vertices[ivertex].rho() = pk2;
-        // Insert it into the first available slot           
-        vertices[nnew].z()     = z1; 
-        vertices[nnew].rho()   = pk1; 
-        // And register it as used
-        vertices[nnew].isGood()= true;
-        // TODO:: this is likely not needed as far as it is reset anytime we call update
-        vertices[nnew].sw()     = 0.;
-        vertices[nnew].se()     = 0.;
-        vertices[nnew].swz()    = 0.;
-        vertices[nnew].swE()    = 0.;
-        vertices[nnew].exp()    = 0.;
-        vertices[nnew].exparg() = 0.;
-	for (int ivnew = maxVerticesPerBlock * blockIdx +  nprev ; ivnew > ivertexO ; ivnew--){ // As we add a vertex, we update from the back downwards
-          vertices[ivnew].order() = vertices[ivnew-1].order();
+        nAllocated = 0;
+        while (nAllocated < std::min(nSplit, maxVerticesPerBlock - nV)){
+          int32_t nnew = allocateVertex(acc, ws);
+          if (nnew < 0) break;
+          newSlots[nAllocated++] = nnew;
         }
-	vertices[ivertexO].order() = nnew;
-	vertices[blockIdx].nV() += 1;
+        if (nAllocated < nSplit) alpaka::atomicOr(acc, ws.overflow, (int32_t) overflowClusterizer, alpaka::hierarchy::Blocks{}); // We want to split but there is no room, report it instead of silently dropping the split
       }
       alpaka::syncBlockThreads(acc);
-      // Now, update kmin/kmax for all tracks
-      for (int itrack = threadIdx+blockIdx*blockSize; itrack < threadIdx+(blockIdx+1)*blockSize ; itrack += blockSize){
-        if (tracks[itrack].kmin() > ivertexO) tracks[itrack].kmin()++;
-        if ((tracks[itrack].kmax() >= ivertexO) || (tracks[itrack].kmax() == tracks[itrack].kmin())) tracks[itrack].kmax()++;	
-      }
-      nprev = vertices[blockIdx].nV();
-      if (once_per_block(acc)){
-        // If we did a splitting or old sorted list of vertex index is scrambled, so we need to fix it
-        for (int resort = 0; resort < ncritical ; ++resort){
-          if (critical_index[resort] > ivertexO) critical_index[resort]++; // critical_index refers to the original vertices->order, so it needs to be updated
+      // Insert the new vertices: each position moves up by the number of splits done below it, and a split vertex gets its lower half right below itself
+      for (int k = threadIdx; k < nV ; k += nThreads){
+        int rank = splitRank[k];
+        int newPosition = base + k + std::min(rank, nAllocated);
+        int ivertex = ws.order[base + k];
+        if ((splitRank[k+1] > rank) && (rank < nAllocated)){
+          int nnew = newSlots[rank];
+          vertices[nnew].z()      = halves[4*k];
+          vertices[nnew].rho()    = halves[4*k+1];
+          vertices[nnew].isGood() = true;
+          vertices[nnew].aux1()   = 0.; // Not to be split in this call
+          // TODO:: this is likely not needed as far as it is reset anytime we call update
+          vertices[nnew].sw()     = 0.;
+          vertices[nnew].se()     = 0.;
+          vertices[nnew].swz()    = 0.;
+          vertices[nnew].swE()    = 0.;
+          vertices[nnew].exp()    = 0.;
+          vertices[nnew].exparg() = 0.;
+          vertices[ivertex].z()   = halves[4*k+2];
+          vertices[ivertex].rho() = halves[4*k+3];
+          ws.orderScratch[newPosition]   = nnew;
+          ws.orderScratch[newPosition+1] = ivertex;
         }
+        else{
+          ws.orderScratch[newPosition] = ivertex;
+        }
+      }
+      // Now, update kmin/kmax for all tracks. A window ending right below a split vertex also gets its lower half
+      for (int itrack = threadIdx+blockIdx*blockSize; itrack < (blockIdx+1)*blockSize ; itrack += nThreads){
+        int kmin = std::min(tracks.kmin(itrack) - base, nV);
+        int kmax = std::min(tracks.kmax(itrack) - base, nV);
+        int newKmin = kmin + std::min(splitRank[kmin], nAllocated);
+        int newKmax = kmax + std::min(splitRank[kmax], nAllocated);
+        if ((kmax < nV) && (splitRank[kmax+1] > splitRank[kmax]) && (splitRank[kmax] < nAllocated)) newKmax++;
+        if (newKmax <= newKmin) newKmax = std::min(newKmin + 1, nV + nAllocated);
+        tracks.kmin(itrack) = base + newKmin;
+        tracks.kmax(itrack) = base + newKmax;
+      }
+      alpaka::syncBlockThreads(acc);
+      for (int k = threadIdx; k < nV + nAllocated ; k += nThreads){
+        ws.order[base + k] = ws.orderScratch[base + k];
       }
+      if (once_per_block(acc)) vertices[blockIdx].nV() = nV + nAllocated;
       alpaka::syncBlockThreads(acc);
+      refreshOrderedZ(acc, vertices, ws);
+      if (nAllocated < nSplit) break; // Out of room, the remaining splits are dropped
+      setTrackSpans(acc, tracks, ws, nV + nAllocated); // The next round goes through the spans of the new list
     }
     alpaka::syncBlockThreads(acc);
   }
   
-  template <bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void purge(const TAcc& acc, portablevertex::TrackDeviceCollection::View tracks, portablevertex::VertexDeviceCollection::View vertices, const portablevertex::ClusterParamsHostCollection::ConstView cParams, double& osumtkwt, double& _beta, double rho0){
+  template <bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void purge(const TAcc& acc, const blockTracks tracks, portablevertex::VertexDeviceCollection::View vertices, const ClusterParamsCollection::ConstView cParams, const clusterizerWorkspace ws, double& osumtkwt, double& _beta, double rho0){
     // Remove repetitive or low quality entries
-    int blockSize = alpaka::getWorkDiv<alpaka::Grid, alpaka::Blocks>(acc)[0u];
+    int nThreads  = alpaka::getWorkDiv<alpaka::Block, alpaka::Threads>(acc)[0u]; // Threads per block, 1 on the CPU backends
     int threadIdx = alpaka::getIdx<alpaka::Block, alpaka::Threads>(acc)[0u]; // Thread number inside block
     int blockIdx  = alpaka::getIdx<alpaka::Grid, alpaka::Blocks>(acc)[0u]; // Block number inside grid
-    int maxVerticesPerBlock = (int) 512/blockSize; // Max vertices size is 512 over number of blocks in grid
+    int maxVerticesPerBlock = ws.maxVerticesPerBlock; // Capacity of the ordered vertex list of each block
     if (vertices[blockIdx].nV() < 2) return;
     double eps = 1e-100;
     int nunique_min = 2;
     double rhoconst = rho0*exp(-_beta*(cParams.dzCutOff()*cParams.dzCutOff()));
     int nprev = vertices[blockIdx].nV();
     // Reassign
-    set_vtx_range(acc, tracks, vertices, cParams, osumtkwt, _beta);
-    for (int ivertexO = maxVerticesPerBlock * blockIdx + threadIdx; ivertexO < maxVerticesPerBlock * blockIdx + vertices[blockIdx].nV() ; ivertexO += blockSize){
-      int ivertex = vertices[ivertexO].order(); // Remember to always take ordering from here when dealing with vertices
-      vertices[ivertex].aux1() = 0; // sum of track-vertex probabilities
-      vertices[ivertex].aux2() = 0; // number of uniquely assigned tracks
-    }
-    alpaka::syncBlockThreads(acc);
-    // Get quality of vertex in terms of #Tracks and sum of track probabilities
-    for (int itrack = threadIdx+blockIdx*blockSize; itrack < threadIdx+(blockIdx+1)*blockSize ; itrack += blockSize){
-      double track_aux1 = ((tracks[itrack].sum_Z() > eps) && (tracks[itrack].weight() > cParams.uniquetrkminp())) ? 1./tracks[itrack].sum_Z() : 0.;
-      for (int ivertexO = tracks[itrack].kmin(); ivertexO < tracks[itrack].kmax() ; ++ivertexO){
-        int ivertex = vertices[ivertexO].order(); // Remember to always take ordering from here when dealing with vertices
-	double ppcut = cParams.uniquetrkweight() * vertices[ivertex].rho() / (vertices[ivertex].rho()+rhoconst);
-	double track_vertex_aux1 = exp(-(_beta)*tracks[itrack].oneoverdz2() * ( (tracks[itrack].z()-vertices[ivertex].z())*(tracks[itrack].z()-vertices[ivertex].z()) ));
-        double p = vertices[ivertex].rho()*track_vertex_aux1*track_aux1; // The whole track-vertex P_ij = rho_j*p_ij*p_i
-        alpaka::atomicAdd(acc, &vertices[ivertex].aux1(), p, alpaka::hierarchy::Threads{});
-        if (p>ppcut) {
-          alpaka::atomicAdd(acc, &vertices[ivertex].aux2(), 1., alpaka::hierarchy::Threads{});
-        }
-      }
+    set_vtx_range(acc, tracks, vertices, cParams, ws, osumtkwt, _beta);
+    // Get quality of vertex in terms of #Tracks and sum of track probabilities, summing over the tracks of the vertex spans with the whole block
+    setTrackSpans(acc, tracks, ws, vertices[blockIdx].nV());
+    sumOverSpans<2>(acc, tracks, ws, vertices[blockIdx].nV(), [](int){ return true; }, [&](int ivertexO, int itrack, double (&t)[2]){
+      int ivertex = ws.order[ivertexO]; // Remember to always take ordering from here when dealing with vertices
+      double ppcut = cParams.uniquetrkweight() * vertices[ivertex].rho() / (vertices[ivertex].rho()+rhoconst);
+      double track_aux1 = ((tracks.sum_Z(itrack) > eps) && (tracks.weight(itrack) > cParams.uniquetrkminp())) ? 1./tracks.sum_Z(itrack) : 0.;
+      double track_vertex_aux1 = exp(-(_beta)*tracks.oneoverdz2(itrack) * ( (tracks.z(itrack)-vertices[ivertex].z())*(tracks.z(itrack)-vertices[ivertex].z()) ));
+      double p = vertices[ivertex].rho()*track_vertex_aux1*track_aux1; // The whole track-vertex P_ij = rho_j*p_ij*p_i
+      t[0] = p; // sum of track-vertex probabilities
+      t[1] = p>ppcut ? 1. : 0.; // number of uniquely assigned tracks
+    });
+    for (int ivertexO = maxVerticesPerBlock * blockIdx + threadIdx; ivertexO < maxVerticesPerBlock * blockIdx + vertices[blockIdx].nV() ; ivertexO += nThreads){
+      int ivertex = ws.order[ivertexO]; // Remember to always take ordering from here when dealing with vertices
+      vertices[ivertex].aux1() = ws.spanSums[maxSpanTerms*ivertexO];
+      vertices[ivertex].aux2() = ws.spanSums[maxSpanTerms*ivertexO + 1];
     }
     alpaka::syncBlockThreads(acc);
-    // Find worst vertex to purge
-    int& k0 = alpaka::declareSharedVar<int, __COUNTER__>(acc);
-
-    if (once_per_block(acc)){
-      double sumpmin = tracks.nT(); // So it is always bigger than aux for any vertex
-      k0 = maxVerticesPerBlock * blockIdx + nprev;
-      for (int ivertexO = maxVerticesPerBlock * blockIdx + threadIdx; ivertexO < maxVerticesPerBlock * blockIdx + (int) vertices[blockIdx].nV() ; ivertexO += blockSize){
-        int ivertex = vertices[ivertexO].order();
-        if ((vertices[ivertex].aux2() < nunique_min) && (vertices[ivertex].aux1() < sumpmin)){
-          // Will purge 
-	  sumpmin = vertices[ivertex].aux1();
-	  k0 = ivertexO;
-        }
-      } // end vertex for
-      if (k0 != (int) (maxVerticesPerBlock * blockIdx + nprev)){
-        for (int ivertexOO = k0; ivertexOO < maxVerticesPerBlock * blockIdx + (int) nprev - 1; ++ivertexOO){ // TODO:: Any tricks here to multithread? I don't think so
-          vertices[ivertexOO].order() =vertices[ivertexOO+1].order(); // Update vertex order taking out the purged one
-        }
-        vertices[blockIdx].nV()--; // Also update nvertex
-      }
-    }// end once_per_block 
-    if (k0 != (int) (maxVerticesPerBlock * blockIdx + (int) nprev)){
-      for (int itrack = threadIdx+blockIdx*blockSize; itrack < threadIdx+(blockIdx+1)*blockSize ; itrack += blockSize){
-        if (tracks[itrack].kmax() > k0) tracks[itrack].kmax()--;
-	if ((tracks[itrack].kmin() > k0) || ((tracks[itrack].kmax() < (tracks[itrack].kmin() + 1)) && (tracks[itrack].kmin() > (int) (maxVerticesPerBlock * blockIdx)))) tracks[itrack].kmin()--;   
+    // Find worst vertex to purge: each thread looks at its own vertices and then the block picks the one with the smallest sum of probabilities
+    int k0 = -1;
+    double sumpmin = tracks.nT(); // So it is always bigger than aux for any vertex
+    for (int ivertexO = maxVerticesPerBlock * blockIdx + threadIdx; ivertexO < maxVerticesPerBlock * blockIdx + nprev ; ivertexO += nThreads){
+      int ivertex = ws.order[ivertexO];
+      if ((vertices[ivertex].aux2() < nunique_min) && (vertices[ivertex].aux1() < sumpmin)){
+        // Will purge 
+        sumpmin = vertices[ivertex].aux1();
+        k0 = ivertexO;
       }
-    } // end if 
-    alpaka::syncBlockThreads(acc);
-    if (nprev != vertices[blockIdx].nV()){
-      set_vtx_range(acc, tracks, vertices, cParams, osumtkwt, _beta);
+    } // end vertex for
+    k0 = blockArgMax(acc, *ws.scratch, -sumpmin, k0);
+    if (k0 < 0) return; // Nothing to purge
+    // Flag every position but the purged one, and compact the list
+    int32_t* keep = ws.positionMap + (maxVerticesPerBlock + 1) * blockIdx;
+    for (int k = threadIdx; k < nprev ; k += nThreads){
+      keep[k] = (maxVerticesPerBlock * blockIdx + k != k0) ? 1 : 0;
     }
+    alpaka::syncBlockThreads(acc);
+    removeFlaggedVertices(acc, tracks, vertices, ws);
+    set_vtx_range(acc, tracks, vertices, cParams, ws, osumtkwt, _beta);
   }
 
-  template <bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void initialize(const TAcc& acc, portablevertex::TrackDeviceCollection::View tracks, portablevertex::VertexDeviceCollection::View vertices, const portablevertex::ClusterParamsHostCollection::ConstView cParams){
-    // Initialize all vertices as empty, a single vertex in each block will be initialized with all tracks associated to it
-    int blockSize = alpaka::getWorkDiv<alpaka::Grid, alpaka::Blocks>(acc)[0u];
+  template <bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void initialize(const TAcc& acc, const blockTracks tracks, portablevertex::VertexDeviceCollection::View vertices, const ClusterParamsCollection::ConstView cParams, const clusterizerWorkspace ws){
+    // Start each block with a single vertex with all tracks associated to it. Only that slot is initialized, the others are set up when split takes them from the pool
+    int blockSize = ws.blockSize; // Tracks per block
+    int nThreads  = alpaka::getWorkDiv<alpaka::Block, alpaka::Threads>(acc)[0u]; // Threads per block, 1 on the CPU backends
     int threadIdx = alpaka::getIdx<alpaka::Block, alpaka::Threads>(acc)[0u]; // Thread number inside block
     int blockIdx  = alpaka::getIdx<alpaka::Grid, alpaka::Blocks>(acc)[0u]; // Block number inside grid
-    int maxVerticesPerBlock = (int) 512/blockSize; // Max vertices size is 512 over number of blocks in grid
-    vertices[blockIdx].nV() = 1; // We start with one vertex per block
-    for (int ivertex = threadIdx+maxVerticesPerBlock*blockIdx; ivertex < maxVerticesPerBlock*(blockIdx+1); ivertex+=blockSize){ // Initialize vertices in parallel in the block
+    int maxVerticesPerBlock = ws.maxVerticesPerBlock; // Capacity of the ordered vertex list of each block
+    if (once_per_block(acc)){
+      vertices[blockIdx].nV() = 1; // We start with one vertex per block
+      ws.nFreeSlots[blockIdx] = 0;
+      int ivertex = allocateVertex(acc, ws); // Always succeeds, the pool has at least one slot per block
       vertices[ivertex].sw() = 0.;
       vertices[ivertex].se() = 0.;
       vertices[ivertex].swz() = 0.;
@@ -463,133 +579,234 @@ namespace ALPAKA_ACCELERATOR_NAMESPACE {
       vertices[ivertex].exp() = 0.;
       vertices[ivertex].exparg() = 0.;
       vertices[ivertex].z() = 0.;
-      vertices[ivertex].rho() = 0.;
-      vertices[ivertex].isGood() = false;
-      vertices[ivertex].order() = 9999;
-      if (ivertex == maxVerticesPerBlock*blockIdx){ // Now set up the initial single vetex containing everything
-        // TODO:: Probably there is a cleaner way of doing this in Alpaka
-	vertices[ivertex].rho() = 1.;
-	vertices[ivertex].order() = maxVerticesPerBlock*blockIdx;
-	vertices[ivertex].isGood() = true;
-      } 
-    } // end for
+      vertices[ivertex].rho() = 1.;
+      vertices[ivertex].isGood() = true;
+      ws.order[maxVerticesPerBlock*blockIdx] = ivertex;
+      ws.orderedZ[0] = 0.;
+    } // end once_per_block
     alpaka::syncBlockThreads(acc);
     // Now assign all tracks in the block to the single vertex
-    for (int itrack = threadIdx+blockIdx*blockSize; itrack < threadIdx+(blockIdx+1)*blockSize ; itrack += blockSize){ // Technically not a loop as each thread will have one track in the per block approach, but in the more general case this can be extended to BlockSize in Alpaka != BlockSize in algorithm
+    for (int itrack = threadIdx+blockIdx*blockSize; itrack < (blockIdx+1)*blockSize ; itrack += nThreads){ // Technically not a loop as each thread will have one track in the per block approach, but in the more general case this can be extended to BlockSize in Alpaka != BlockSize in algorithm
       tracks.kmin(itrack) = maxVerticesPerBlock*blockIdx; // Tracks are associated to vertex in list kmin, kmin+1,... kmax-1, so this just assign all tracks to the vertex we just created!
       tracks.kmax(itrack) = maxVerticesPerBlock*blockIdx + 1;
     }
-    if (once_per_block(acc)){
-      for (int ivertex =0 ; ivertex < maxVerticesPerBlock*(blockIdx+1); ivertex += 1){
-        vertices[ivertex].sw() = 0.;
-        vertices[ivertex].se() = 0.;
-        vertices[ivertex].swz() = 0.;
-        vertices[ivertex].swE() = 0.;
-        vertices[ivertex].exp() = 0.;
-        vertices[ivertex].exparg() = 0.;
-        vertices[ivertex].z() = 0.;
-        vertices[ivertex].rho() = 0.;
-        vertices[ivertex].isGood() = false;
-        vertices[ivertex].order() = 9999;
-        if (ivertex == maxVerticesPerBlock*blockIdx){ // Now set up the initial single vertex containing everything
-          // TODO:: Probably there is a cleaner way of doing this in Alpaka
-          vertices[ivertex].rho() = 1.;
-          vertices[ivertex].order() = maxVerticesPerBlock*blockIdx;
-          vertices[ivertex].isGood() = true;
-        } 
-      }
-      for (int itrack = 0 ; itrack < (blockIdx+1)*blockSize ; itrack += blockSize){
-        tracks.kmin(itrack) = maxVerticesPerBlock*blockIdx;
-	tracks.kmax(itrack) = maxVerticesPerBlock*blockIdx + 1;
-      }
+    // The track-vertex storage still holds the terms of the previous event, mark all of them as stale. Without a tolerance the stored exponents are not kept
+    if (ws.expCacheTolerance > 0) for (int icache = ws.trackVertexCapacity * blockIdx + threadIdx; icache < ws.trackVertexCapacity * (blockIdx + 1); icache += nThreads){
+      ws.trackVertexArg[icache] = std::numeric_limits<double>::quiet_NaN();
     }
     alpaka::syncBlockThreads(acc);
   }
   
-  template <bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void getBeta0(const TAcc& acc, portablevertex::TrackDeviceCollection::View tracks, portablevertex::VertexDeviceCollection::View vertices, const portablevertex::ClusterParamsHostCollection::ConstView cParams, double& _beta){
+  ALPAKA_FN_ACC static double firstCoolingStep(const ClusterParamsCollection::ConstView cParams, double Tc){
+    // beta of the first step of the cooling ladder TMin/coolingFactor^n that is below the critical temperature Tc
+    if (Tc > cParams.TMin()){ // If T_C > T_Min we have a game to play
+      int coolingsteps = 1 - int(std::log(Tc/ cParams.TMin()) / std::log(cParams.coolingFactor())); // A tricky conversion to round the number of cooling steps
+      return std::pow(cParams.coolingFactor(), coolingsteps)/cParams.TMin(); // First cooling step
+    }
+    return cParams.coolingFactor()/cParams.TMin(); // Otherwise, just one step
+  }
+
+  template <bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void getBeta0(const TAcc& acc, const blockTracks tracks, portablevertex::VertexDeviceCollection::View vertices, const ClusterParamsCollection::ConstView cParams, const clusterizerWorkspace ws, double& _beta){
     // Computes first critical temperature
-    int blockSize = alpaka::getWorkDiv<alpaka::Grid, alpaka::Blocks>(acc)[0u];
+    int blockSize = ws.blockSize; // Tracks per block
+    int nThreads  = alpaka::getWorkDiv<alpaka::Block, alpaka::Threads>(acc)[0u]; // Threads per block, 1 on the CPU backends
     int threadIdx = alpaka::getIdx<alpaka::Block, alpaka::Threads>(acc)[0u]; // Thread number inside block
     int blockIdx  = alpaka::getIdx<alpaka::Grid, alpaka::Blocks>(acc)[0u]; // Block number inside grid
-    int maxVerticesPerBlock = (int) 512/blockSize; // Max vertices size is 512 over number of blocks in grid
-    for (int itrack = threadIdx+blockIdx*blockSize; itrack < threadIdx+(blockIdx+1)*blockSize ; itrack += blockSize){
-      tracks[itrack].aux1() = tracks[itrack].weight()*tracks[itrack].oneoverdz2();  // Weighted weight
-      tracks[itrack].aux2() = tracks[itrack].weight()*tracks[itrack].oneoverdz2()*tracks[itrack].z(); // Weighted position
+    int maxVerticesPerBlock = ws.maxVerticesPerBlock; // Capacity of the ordered vertex list of each block
+    int ivertex0 = ws.order[maxVerticesPerBlock*blockIdx]; // The single vertex made by initialize
+    for (int itrack = threadIdx+blockIdx*blockSize; itrack < (blockIdx+1)*blockSize ; itrack += nThreads){
+      tracks.aux1(itrack) = tracks.weight(itrack)*tracks.oneoverdz2(itrack);  // Weighted weight
+      tracks.aux2(itrack) = tracks.weight(itrack)*tracks.oneoverdz2(itrack)*tracks.z(itrack); // Weighted position
     }
     // Initial vertex position
-    alpaka::syncBlockThreads(acc);
-    double& wnew = alpaka::declareSharedVar<double, __COUNTER__>(acc);
-    double& znew = alpaka::declareSharedVar<double, __COUNTER__>(acc);
+    double wnew = 0.;
+    double znew = 0.;
+    for (int itrack = threadIdx+blockIdx*blockSize; itrack < (blockIdx+1)*blockSize ; itrack += nThreads){ // TODO:Saving and reading in the tracks dataformat might be a bit too much?
+      wnew += tracks.aux1(itrack);
+      znew += tracks.aux2(itrack);
+    }
+    wnew = blockSum(acc, *ws.scratch, wnew);
+    znew = blockSum(acc, *ws.scratch, znew);
+    double z0 = znew/wnew; // All threads have the block sums, so there is no need to go through the vertex
+    if (once_per_block(acc)){
+      vertices[ivertex0].z() = z0;
+      ws.orderedZ[0] = z0;
+    }
+    // Now do a chi-2 like of all tracks and save it again in znew
+    znew = 0.;
+    for (int itrack = threadIdx+blockIdx*blockSize; itrack < (blockIdx+1)*blockSize ; itrack += nThreads){
+      tracks.aux2(itrack) = tracks.aux1(itrack)*(z0 - tracks.z(itrack) )*(z0 - tracks.z(itrack))*tracks.oneoverdz2(itrack);
+      znew += tracks.aux2(itrack);
+    }
+    znew = blockSum(acc, *ws.scratch, znew);
     if (once_per_block(acc)){
-      wnew = 0.;
-      znew = 0.;
+      _beta = firstCoolingStep(cParams, 2 * znew/wnew); // 2*chi2/w is 1/beta_C, or T_C
     }
     alpaka::syncBlockThreads(acc);
-    for (int itrack = threadIdx+blockIdx*blockSize; itrack < threadIdx+(blockIdx+1)*blockSize ; itrack += blockSize){ // TODO:Saving and reading in the tracks dataformat might be a bit too much?
-      alpaka::atomicAdd(acc, &wnew, tracks[itrack].aux1(), alpaka::hierarchy::Threads{});
-      alpaka::atomicAdd(acc, &znew, tracks[itrack].aux2(), alpaka::hierarchy::Threads{});
+  }
+
+  template <bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static bool seedFromHistogram(const TAcc& acc, const blockTracks tracks, portablevertex::VertexDeviceCollection::View vertices, const ClusterParamsCollection::ConstView cParams, const clusterizerWorkspace ws, double& _beta){
+    // Alternative to getBeta0: one vertex per peak of the weighted z histogram of the block tracks, and the cooling starts from the highest critical temperature of the seeded clusters instead of the one of the whole block
+    // Returns false, with the single vertex of initialize untouched, if there are fewer than two peaks. All threads get the same answer
+    int blockSize = ws.blockSize; // Tracks per block
+    int nThreads  = alpaka::getWorkDiv<alpaka::Block, alpaka::Threads>(acc)[0u]; // Threads per block, 1 on the CPU backends
+    int threadIdx = alpaka::getIdx<alpaka::Block, alpaka::Threads>(acc)[0u]; // Thread number inside block
+    int blockIdx  = alpaka::getIdx<alpaka::Grid, alpaka::Blocks>(acc)[0u]; // Block number inside grid
+    int gridSize  = alpaka::getWorkDiv<alpaka::Grid, alpaka::Blocks>(acc)[0u]; // Number of blocks
+    int maxVerticesPerBlock = ws.maxVerticesPerBlock; // Capacity of the ordered vertex list of each block
+    int base = maxVerticesPerBlock * blockIdx; // First position of the ordered list of this block
+    auto& histogram = alpaka::declareSharedVar<double[maxSeedBins], __COUNTER__>(acc);
+    auto& peakRank  = alpaka::declareSharedVar<int32_t[maxSeedBins + 1], __COUNTER__>(acc);
+    int32_t& nSeeds = alpaka::declareSharedVar<int32_t, __COUNTER__>(acc);
+    // Histogram range from the tracks that carry weight, padding tracks do not
+    double zmin = std::numeric_limits<double>::max();
+    double zmax = -std::numeric_limits<double>::max();
+    for (int itrack = threadIdx+blockIdx*blockSize; itrack < (blockIdx+1)*blockSize ; itrack += nThreads){
+      if (not(tracks.weight(itrack) > 0)) continue;
+      zmin = std::min(zmin, tracks.z(itrack));
+      zmax = std::max(zmax, tracks.z(itrack));
     }
+    zmin = -blockMax(acc, *ws.scratch, -zmin);
+    zmax = blockMax(acc, *ws.scratch, zmax);
+    if (not(zmax > zmin)) return false;
+    double binSize = std::max(ws.seedBinSize, (zmax - zmin) / (maxSeedBins - 1)); // Coarser bins if the block is too wide for the shared histogram
+    int nBins = std::min(maxSeedBins, int((zmax - zmin) / binSize) + 1);
+    // Tracks are sorted in z, so the bin index does not decrease along the block and each bin is a run of consecutive tracks. The histogram is filled in a single pass over the tracks, with a segmented block sum per bin
+    // The combination order only depends on the track order, so the bin sums do not depend on the scheduling
+    for (int ibin = threadIdx; ibin < nBins; ibin += nThreads) histogram[ibin] = 0.;
     alpaka::syncBlockThreads(acc);
-    if (once_per_block(acc)){
-      vertices[maxVerticesPerBlock*blockIdx].z() = znew/wnew;
-      znew = 0.;
+    for (int first = blockIdx*blockSize; first < (blockIdx+1)*blockSize; first += nThreads){ // Same number of rounds for all threads, as the segmented sums are collective
+      int itrack = first + threadIdx;
+      int ibin = nBins; // Threads past the end of the block form a segment of their own
+      double w = 0.;
+      if (itrack < (blockIdx+1)*blockSize){
+        ibin = std::max(0, std::min(nBins - 1, int((tracks.z(itrack) - zmin) / binSize))); // Tracks without weight can be out of range, they still keep the order
+        if (tracks.weight(itrack) > 0) w = tracks.weight(itrack);
+      }
+      bool last;
+      double content = blockSegmentedSum(acc, *ws.scratch, w, ibin, last);
+      if (last && (ibin < nBins)) histogram[ibin] += content; // A single thread per bin and round, the rounds are ordered by the syncs of the segmented sums
     }
     alpaka::syncBlockThreads(acc);
-    // Now do a chi-2 like of all tracks and save it again in znew
-    for (int itrack = threadIdx+blockIdx*blockSize; itrack < threadIdx+(blockIdx+1)*blockSize ; itrack += blockSize){
-      tracks[itrack].aux2() = tracks[itrack].aux1()*(vertices[maxVerticesPerBlock*blockIdx].z() - tracks[itrack].z() )*(vertices[maxVerticesPerBlock*blockIdx].z() - tracks[itrack].z())*tracks[itrack].oneoverdz2();
-      alpaka::atomicAdd(acc, &znew, tracks[itrack].aux2(), alpaka::hierarchy::Threads{});
+    double blockWeight = 0.;
+    for (int ibin = threadIdx; ibin < nBins; ibin += nThreads) blockWeight += histogram[ibin];
+    blockWeight = blockSum(acc, *ws.scratch, blockWeight); // Also syncs, so the histogram is complete
+    // Peaks are local maxima above seedMinWeight. The left edge of a plateau is the peak, so two neighbouring bins are never both peaks
+    for (int ibin = threadIdx; ibin < nBins; ibin += nThreads){
+      double left  = ibin > 0 ? histogram[ibin - 1] : 0.;
+      double right = ibin < nBins - 1 ? histogram[ibin + 1] : 0.;
+      peakRank[ibin] = ((histogram[ibin] >= ws.seedMinWeight) && (histogram[ibin] > left) && (histogram[ibin] >= right)) ? 1 : 0;
     }
+    if (once_per_block(acc)) peakRank[nBins] = 0;
     alpaka::syncBlockThreads(acc);
+    int32_t nPeaks = blockExclusiveScan(acc, *ws.scratch, peakRank, nBins + 1);
+    if (nPeaks < 2) return false;
+    // Take the vertex slots, the one from initialize goes to the lowest peak. The block does not take more than its share of the pool, further peaks are left to the splits
     if (once_per_block(acc)){
-      _beta = 2 * znew/wnew; // 1/beta_C, or T_C
-      if (_beta > cParams.TMin()){ // If T_C > T_Min we have a game to play
-        int coolingsteps = 1 - int(std::log(_beta/ cParams.TMin()) / std::log(cParams.coolingFactor())); // A tricky conversion to round the number of cooling steps
-        _beta = std::pow(cParams.coolingFactor(), coolingsteps)/cParams.TMin(); // First cooling step
+      int nWanted = std::min(nPeaks, std::min(maxVerticesPerBlock, std::max(1, ws.maxVertices / gridSize)));
+      nSeeds = 1;
+      while (nSeeds < nWanted){
+        int ivertex = allocateVertex(acc, ws);
+        if (ivertex < 0) break;
+        ws.order[base + nSeeds] = ivertex;
+        nSeeds++;
       }
-      else _beta = cParams.coolingFactor()/cParams.TMin(); // Otherwise, just one step
+      vertices[blockIdx].nV() = nSeeds;
+    }
+    alpaka::syncBlockThreads(acc);
+    // Seed at the centroid of the peak bin and its neighbours, with a mass in proportion to their content. Peaks are in z order, so the list is already sorted
+    for (int ibin = threadIdx; ibin < nBins; ibin += nThreads){
+      int k = peakRank[ibin];
+      if ((peakRank[ibin + 1] == k) || (k >= nSeeds)) continue; // Not a peak, or no room for it
+      double sumw = 0.;
+      double sumwz = 0.;
+      for (int jbin = std::max(0, ibin - 1); jbin <= std::min(nBins - 1, ibin + 1); jbin++){
+        sumw  += histogram[jbin];
+        sumwz += histogram[jbin] * (zmin + (jbin + 0.5) * binSize);
+      }
+      int ivertex = ws.order[base + k];
+      vertices[ivertex].sw() = 0.;
+      vertices[ivertex].se() = 0.;
+      vertices[ivertex].swz() = 0.;
+      vertices[ivertex].swE() = 0.;
+      vertices[ivertex].exp() = 0.;
+      vertices[ivertex].exparg() = 0.;
+      vertices[ivertex].aux1() = 0.;
+      vertices[ivertex].z() = sumwz / sumw;
+      vertices[ivertex].rho() = sumw / blockWeight;
+      vertices[ivertex].isGood() = true;
+      ws.orderedZ[k] = sumwz / sumw;
+    }
+    alpaka::syncBlockThreads(acc);
+    // Critical temperature of each seeded cluster, with the tracks going to the closest seed, as getBeta0 does for the whole block
+    for (int itrack = threadIdx+blockIdx*blockSize; itrack < (blockIdx+1)*blockSize ; itrack += nThreads){
+      int k = lowerBound(ws.orderedZ, nSeeds, tracks.z(itrack));
+      if ((k == nSeeds) || ((k > 0) && (tracks.z(itrack) - ws.orderedZ[k - 1] < ws.orderedZ[k] - tracks.z(itrack)))) k--;
+      tracks.kmin(itrack) = base + k;
+      tracks.kmax(itrack) = base + k + 1;
+    }
+    setTrackSpans(acc, tracks, ws, nSeeds); // Also syncs
+    sumOverSpans<2>(acc, tracks, ws, nSeeds, [](int){ return true; }, [&](int ivertexO, int itrack, double (&t)[2]){
+      if (tracks.kmin(itrack) != ivertexO) return;
+      double w = tracks.weight(itrack)*tracks.oneoverdz2(itrack);
+      double dz = ws.orderedZ[ivertexO - base] - tracks.z(itrack);
+      t[0] = w;
+      t[1] = w*dz*dz*tracks.oneoverdz2(itrack);
+    });
+    double Tc = 0.;
+    for (int ivertexO = base + threadIdx; ivertexO < base + nSeeds; ivertexO += nThreads){
+      double sw = ws.spanSums[maxSpanTerms*ivertexO];
+      double swdz2 = ws.spanSums[maxSpanTerms*ivertexO + 1];
+      if (sw > 0) Tc = std::max(Tc, 2 * swdz2/sw);
+    }
+    Tc = blockMax(acc, *ws.scratch, Tc);
+    if (once_per_block(acc)){
+      _beta = firstCoolingStep(cParams, Tc);
     }
     alpaka::syncBlockThreads(acc);
+    return true;
   }
 
-  template <bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void thermalize(const TAcc& acc, portablevertex::TrackDeviceCollection::View tracks, portablevertex::VertexDeviceCollection::View vertices, const portablevertex::ClusterParamsHostCollection::ConstView cParams, double& osumtkwt, double& _beta, double delta_highT, double rho0){
-    // At a fixed temperature, iterate vertex position update until stable
-    int blockSize = alpaka::getWorkDiv<alpaka::Grid, alpaka::Blocks>(acc)[0u];
+  template <int32_t convergenceMode, bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static int thermalize(const TAcc& acc, const blockTracks tracks, portablevertex::VertexDeviceCollection::View vertices, const ClusterParamsCollection::ConstView cParams, const clusterizerWorkspace ws, double& osumtkwt, double& _beta, double delta_highT, double rho0){
+    // At a fixed temperature, iterate vertex position update until stable. Returns the number of iterations it took
+    int nThreads  = alpaka::getWorkDiv<alpaka::Block, alpaka::Threads>(acc)[0u]; // Threads per block, 1 on the CPU backends
+    int threadIdx = alpaka::getIdx<alpaka::Block, alpaka::Threads>(acc)[0u]; // Thread number inside block
     int blockIdx  = alpaka::getIdx<alpaka::Grid, alpaka::Blocks>(acc)[0u]; // Block number inside grid
-    int maxVerticesPerBlock = (int) 512/blockSize; // Max vertices size is 512 over number of blocks in grid
+    int maxVerticesPerBlock = ws.maxVerticesPerBlock; // Capacity of the ordered vertex list of each block
     // Thermalizing iteration
     int niter = 0; 
     double zrange_min_ = 0.01; // Hard coded as in CPU
     double delta_max = cParams.delta_lowT();
     alpaka::syncBlockThreads(acc);
-    // Stepping definition
-    if (cParams.convergence_mode() == 0){
+    // Stepping definition, fixed at compile time so the kernel only carries the one in use
+    if constexpr (convergenceMode == convergenceFixed){
       delta_max = delta_highT;
     }
-    else if (cParams.convergence_mode() == 1){
+    else {
       delta_max = cParams.delta_lowT() / sqrt(std::max(_beta, 1.0));
     }
     int maxIterations = 1000;
     alpaka::syncBlockThreads(acc);
     // Always start by resetting track-vertex assignment
-    set_vtx_range(acc, tracks, vertices, cParams, osumtkwt, _beta);
+    set_vtx_range(acc, tracks, vertices, cParams, ws, osumtkwt, _beta);
     alpaka::syncBlockThreads(acc);
     // Accumulator of variations
     double delta_sum_range = 0;
     while (niter++ < maxIterations){ // Loop until vertex position change is small
       // One iteration of new vertex positions
-      update(acc, tracks, vertices, cParams, osumtkwt, _beta, rho0, false);
+      update(acc, tracks, vertices, cParams, ws, osumtkwt, _beta, rho0, false);
       alpaka::syncBlockThreads(acc);
       // One iteration of max variation
       double dmax = 0.;
-      for (int ivertexO = maxVerticesPerBlock*blockIdx ; ivertexO < maxVerticesPerBlock*blockIdx + vertices[blockIdx].nV(); ivertexO++){ // TODO::Currently we are doing this in all threads in parallel, might be optimized in other way to multithread max finding?
-        int ivertex = vertices[ivertexO].order();
+      for (int ivertexO = maxVerticesPerBlock*blockIdx + threadIdx ; ivertexO < maxVerticesPerBlock*blockIdx + vertices[blockIdx].nV(); ivertexO += nThreads){
+        int ivertex = ws.order[ivertexO];
         if (vertices[ivertex].aux1() >= dmax) dmax = vertices[ivertex].aux1();
       }
+      dmax = blockMax(acc, *ws.scratch, dmax); // All threads need it to agree on when to stop
       delta_sum_range += dmax;
       alpaka::syncBlockThreads(acc);
       if (delta_sum_range > zrange_min_ && dmax > zrange_min_) {  // I.e., if a vertex moved too much we reassign
-        set_vtx_range(acc, tracks, vertices, cParams, osumtkwt, _beta);
+        set_vtx_range(acc, tracks, vertices, cParams, ws, osumtkwt, _beta);
 	delta_sum_range = 0.;
       }
       alpaka::syncBlockThreads(acc);
@@ -597,106 +814,119 @@ namespace ALPAKA_ACCELERATOR_NAMESPACE {
         break;
       }
     } // end while
+    return niter;
   } // thermalize
 
-  template <bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void coolingWhileSplitting(const TAcc& acc, portablevertex::TrackDeviceCollection::View tracks, portablevertex::VertexDeviceCollection::View vertices, const portablevertex::ClusterParamsHostCollection::ConstView cParams, double& osumtkwt, double& _beta){
+  template <int32_t convergenceMode, bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void coolingWhileSplitting(const TAcc& acc, const blockTracks tracks, portablevertex::VertexDeviceCollection::View vertices, const ClusterParamsCollection::ConstView cParams, const clusterizerWorkspace ws, double& osumtkwt, double& _beta){
     // Perform cooling of the deterministic annealing
     int blockIdx  = alpaka::getIdx<alpaka::Grid, alpaka::Blocks>(acc)[0u]; // Block number inside grid
     double betafreeze = (1./cParams.TMin()) * sqrt(cParams.coolingFactor()); // Last temperature
+    double coolingFactor = cParams.coolingFactor(); // Current step, only changes in the adaptive mode. Every thread follows the same block-wide decisions, so there is no need to share it
+    int nSteps = 0;
     while (_beta < betafreeze){ // The cooling loop
       alpaka::syncBlockThreads(acc);
       int nprev = vertices[blockIdx].nV();
       alpaka::syncBlockThreads(acc);
-      merge(acc, tracks, vertices, cParams, osumtkwt, _beta);
+      merge(acc, tracks, vertices, cParams, ws, osumtkwt, _beta);
       alpaka::syncBlockThreads(acc);
       while (nprev !=  vertices[blockIdx].nV() ) { // If we are here, we merged before, keep merging until stable
         nprev = vertices[blockIdx].nV();
 	alpaka::syncBlockThreads(acc);
-	update(acc, tracks, vertices, cParams, osumtkwt, _beta, 0.0, false); // Update positions after merge
+	update(acc, tracks, vertices, cParams, ws, osumtkwt, _beta, 0.0, false); // Update positions after merge
 	alpaka::syncBlockThreads(acc);
-	merge(acc, tracks, vertices, cParams, osumtkwt, _beta);
+	merge(acc, tracks, vertices, cParams, ws, osumtkwt, _beta);
 	alpaka::syncBlockThreads(acc);
       } // end while after merging
-      split(acc, tracks, vertices, cParams, osumtkwt, _beta, 1.0); // As we are close to a critical temperature, check if we need to split and if so, do it
+      nprev = vertices[blockIdx].nV();
       alpaka::syncBlockThreads(acc);
+      split(acc, tracks, vertices, cParams, ws, osumtkwt, _beta, 1.0); // As we are close to a critical temperature, check if we need to split and if so, do it
+      alpaka::syncBlockThreads(acc);
+      bool splitting = nprev != vertices[blockIdx].nV();
       if (once_per_block(acc)){ // Cool down
-	_beta = _beta/cParams.coolingFactor();
+        if (ws.coolingMode == coolingAdaptive) _beta = std::min(_beta/coolingFactor, 1./cParams.TMin()); // Larger steps must not go past Tmin, which stays the last temperature
+	else _beta = _beta/coolingFactor;
       }
       alpaka::syncBlockThreads(acc);
-      thermalize(acc, tracks, vertices, cParams, osumtkwt, _beta, cParams.delta_highT(), 0.0); // Stabilize positions after cooling
+      int niter = thermalize<convergenceMode>(acc, tracks, vertices, cParams, ws, osumtkwt, _beta, cParams.delta_highT(), 0.0); // Stabilize positions after cooling
       alpaka::syncBlockThreads(acc);
-      set_vtx_range(acc, tracks, vertices, cParams, osumtkwt, _beta); // Reassign tracks to vertex
+      nSteps++;
+      if (ws.coolingMode == coolingAdaptive){
+        if (splitting) coolingFactor = std::min(sqrt(coolingFactor), sqrt(cParams.coolingFactor())); // Structure is forming: halve the step (in log T), down to half the standard one
+        else if (niter <= ws.coolingQuietIterations) coolingFactor = std::max(coolingFactor*coolingFactor, ws.coolingMinFactor); // Nothing happens at this temperature: double the step, up to coolingMinFactor
+      }
+      set_vtx_range(acc, tracks, vertices, cParams, ws, osumtkwt, _beta); // Reassign tracks to vertex
       alpaka::syncBlockThreads(acc);
-      update(acc, tracks, vertices, cParams, osumtkwt, _beta, 0.0, false); // Last, update positions again
+      update(acc, tracks, vertices, cParams, ws, osumtkwt, _beta, 0.0, false); // Last, update positions again
       alpaka::syncBlockThreads(acc);
     }
+    if (once_per_block(acc)) ws.coolingSteps[blockIdx] = nSteps;
   } // end coolingWhileSplitting
 
-  template <bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void reMergeTracks(const TAcc& acc, portablevertex::TrackDeviceCollection::View tracks, portablevertex::VertexDeviceCollection::View vertices, const portablevertex::ClusterParamsHostCollection::ConstView cParams, double& osumtkwt, double& _beta){
+  template <bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void reMergeTracks(const TAcc& acc, const blockTracks tracks, portablevertex::VertexDeviceCollection::View vertices, const ClusterParamsCollection::ConstView cParams, const clusterizerWorkspace ws, double& osumtkwt, double& _beta){
     // After the cooling, we merge any closeby vertices
     int blockIdx  = alpaka::getIdx<alpaka::Grid, alpaka::Blocks>(acc)[0u]; // Block number inside grid
     int nprev = vertices[blockIdx].nV();
-    merge(acc, tracks, vertices, cParams, osumtkwt, _beta);
+    merge(acc, tracks, vertices, cParams, ws, osumtkwt, _beta);
     while (nprev !=  vertices[blockIdx].nV() ) { // If we are here, we merged before, keep merging until stable
-      set_vtx_range(acc, tracks, vertices, cParams, osumtkwt, _beta); // Reassign tracks to vertex
+      set_vtx_range(acc, tracks, vertices, cParams, ws, osumtkwt, _beta); // Reassign tracks to vertex
       alpaka::syncBlockThreads(acc);
-      update(acc, tracks, vertices, cParams, osumtkwt, _beta, 0.0, false); // Update before any final merge
+      update(acc, tracks, vertices, cParams, ws, osumtkwt, _beta, 0.0, false); // Update before any final merge
       alpaka::syncBlockThreads(acc);
       nprev = vertices[blockIdx].nV();
-      merge(acc, tracks, vertices, cParams, osumtkwt, _beta);
+      merge(acc, tracks, vertices, cParams, ws, osumtkwt, _beta);
       alpaka::syncBlockThreads(acc);
     } // end while
   } // end reMergeTracks
   
-  template <bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void reSplitTracks(const TAcc& acc, portablevertex::TrackDeviceCollection::View tracks, portablevertex::VertexDeviceCollection::View vertices, const portablevertex::ClusterParamsHostCollection::ConstView cParams, double& osumtkwt, double& _beta){
+  template <int32_t convergenceMode, bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void reSplitTracks(const TAcc& acc, const blockTracks tracks, portablevertex::VertexDeviceCollection::View vertices, const ClusterParamsCollection::ConstView cParams, const clusterizerWorkspace ws, double& osumtkwt, double& _beta){
     // Last splitting at the minimal temperature which is a bit more permissive
     int blockIdx  = alpaka::getIdx<alpaka::Grid, alpaka::Blocks>(acc)[0u]; // Block number inside grid
     int ntry = 0; 
     double threshold = 1.0;
     int nprev = vertices[blockIdx].nV();
-    split(acc, tracks, vertices, cParams, osumtkwt, _beta, threshold);
+    split(acc, tracks, vertices, cParams, ws, osumtkwt, _beta, threshold);
     while (nprev !=  vertices[blockIdx].nV() && (ntry++ < 10)) {
-      thermalize(acc, tracks, vertices, cParams, osumtkwt, _beta, cParams.delta_highT(), 0.0);
+      thermalize<convergenceMode>(acc, tracks, vertices, cParams, ws, osumtkwt, _beta, cParams.delta_highT(), 0.0);
       alpaka::syncBlockThreads(acc);
       nprev = vertices[blockIdx].nV();
-      merge(acc, tracks, vertices, cParams, osumtkwt, _beta);
+      merge(acc, tracks, vertices, cParams, ws, osumtkwt, _beta);
       alpaka::syncBlockThreads(acc);
       while (nprev !=  vertices[blockIdx].nV() ) {
 	nprev = vertices[blockIdx].nV();
-        update(acc, tracks, vertices, cParams, osumtkwt, _beta, 0.0, false);
+        update(acc, tracks, vertices, cParams, ws, osumtkwt, _beta, 0.0, false);
 	alpaka::syncBlockThreads(acc);
-        merge(acc, tracks, vertices, cParams, osumtkwt, _beta);
+        merge(acc, tracks, vertices, cParams, ws, osumtkwt, _beta);
 	alpaka::syncBlockThreads(acc);
       }
       threshold *= 1.1; // Make it a bit easier to split
-      split(acc, tracks, vertices, cParams, osumtkwt, _beta, threshold);
+      split(acc, tracks, vertices, cParams, ws, osumtkwt, _beta, threshold);
       alpaka::syncBlockThreads(acc);
     }
   }
 
-  template <bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void rejectOutliers(const TAcc& acc, portablevertex::TrackDeviceCollection::View tracks, portablevertex::VertexDeviceCollection::View vertices, const portablevertex::ClusterParamsHostCollection::ConstView cParams, double& osumtkwt, double& _beta){
+  template <int32_t convergenceMode, bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void rejectOutliers(const TAcc& acc, const blockTracks tracks, portablevertex::VertexDeviceCollection::View vertices, const ClusterParamsCollection::ConstView cParams, const clusterizerWorkspace ws, double& osumtkwt, double& _beta){
     // Treat outliers, either low quality vertex, or those with very far away tracks
     int blockIdx  = alpaka::getIdx<alpaka::Grid, alpaka::Blocks>(acc)[0u]; // Block number inside grid
     double rho0 = 0.0; // Yes, here is where this thing is used
     if (cParams.dzCutOff() > 0){
       rho0 = vertices[blockIdx].nV() > 1 ? 1./vertices[blockIdx].nV() : 1.;
       for (int rhoindex = 0; rhoindex < 5 ; rhoindex++){ //Can't be parallelized in any reasonable way
-        update(acc, tracks, vertices, cParams, osumtkwt, _beta, rhoindex*rho0/5., false);
+        update(acc, tracks, vertices, cParams, ws, osumtkwt, _beta, rhoindex*rho0/5., false);
         alpaka::syncBlockThreads(acc);
       }
     } // end if
-    thermalize(acc, tracks, vertices, cParams, osumtkwt, _beta, cParams.delta_lowT(), rho0);
+    thermalize<convergenceMode>(acc, tracks, vertices, cParams, ws, osumtkwt, _beta, cParams.delta_lowT(), rho0);
     int nprev = vertices[blockIdx].nV();
     alpaka::syncBlockThreads(acc);
-    merge(acc, tracks, vertices, cParams, osumtkwt, _beta);
+    merge(acc, tracks, vertices, cParams, ws, osumtkwt, _beta);
     alpaka::syncBlockThreads(acc);
     while (nprev !=  vertices[blockIdx].nV()) {
-      set_vtx_range(acc, tracks, vertices, cParams, osumtkwt, _beta); // Reassign tracks to vertex
+      set_vtx_range(acc, tracks, vertices, cParams, ws, osumtkwt, _beta); // Reassign tracks to vertex
       alpaka::syncBlockThreads(acc);
-      update(acc, tracks, vertices, cParams, osumtkwt, _beta, rho0, false); // At rho0 it changes the initial value of the partition function
+      update(acc, tracks, vertices, cParams, ws, osumtkwt, _beta, rho0, false); // At rho0 it changes the initial value of the partition function
       alpaka::syncBlockThreads(acc);
       nprev = vertices[blockIdx].nV();
-      merge(acc, tracks, vertices, cParams, osumtkwt, _beta);
+      merge(acc, tracks, vertices, cParams, ws, osumtkwt, _beta);
       alpaka::syncBlockThreads(acc);
     }
     while (_beta < 1./cParams.Tpurge()){ // Cool down to purge temperature
@@ -705,17 +935,17 @@ namespace ALPAKA_ACCELERATOR_NAMESPACE {
         _beta = std::min(_beta/cParams.coolingFactor(), 1./cParams.Tpurge());
       }
       alpaka::syncBlockThreads(acc);
-      thermalize(acc, tracks, vertices, cParams, osumtkwt, _beta, cParams.delta_lowT(), rho0);
+      thermalize<convergenceMode>(acc, tracks, vertices, cParams, ws, osumtkwt, _beta, cParams.delta_lowT(), rho0);
     }
     alpaka::syncBlockThreads(acc);
     // And now purge
     nprev = vertices[blockIdx].nV();
-    purge(acc, tracks, vertices, cParams, osumtkwt, _beta, rho0);
+    purge(acc, tracks, vertices, cParams, ws, osumtkwt, _beta, rho0);
     while (nprev !=  vertices[blockIdx].nV()) {
-      thermalize(acc, tracks, vertices, cParams, osumtkwt, _beta, cParams.delta_lowT(), rho0);
+      thermalize<convergenceMode>(acc, tracks, vertices, cParams, ws, osumtkwt, _beta, cParams.delta_lowT(), rho0);
       nprev = vertices[blockIdx].nV();
       alpaka::syncBlockThreads(acc);
-      purge(acc, tracks, vertices, cParams, osumtkwt, _beta, rho0);
+      purge(acc, tracks, vertices, cParams, ws, osumtkwt, _beta, rho0);
       alpaka::syncBlockThreads(acc);
     }
     while (_beta < 1./cParams.Tstop()){ // Cool down to stop temperature
@@ -724,275 +954,485 @@ namespace ALPAKA_ACCELERATOR_NAMESPACE {
         _beta = std::min(_beta/cParams.coolingFactor(), 1./cParams.Tstop());
       }
       alpaka::syncBlockThreads(acc);
-      thermalize(acc, tracks, vertices, cParams, osumtkwt, _beta, cParams.delta_lowT(), rho0);
+      thermalize<convergenceMode>(acc, tracks, vertices, cParams, ws, osumtkwt, _beta, cParams.delta_lowT(), rho0);
     }
     alpaka::syncBlockThreads(acc);
     // The last track to vertex assignment of the clusterizer!
-    set_vtx_range(acc, tracks, vertices, cParams, osumtkwt, _beta);
+    set_vtx_range(acc, tracks, vertices, cParams, ws, osumtkwt, _beta);
     alpaka::syncBlockThreads(acc);
   } // rejectOutliers
 
-  template <bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void resortVerticesAndAssign(const TAcc& acc, portablevertex::TrackDeviceCollection::View tracks, portablevertex::VertexDeviceCollection::View vertices, const portablevertex::ClusterParamsHostCollection::ConstView cParams, int32_t griddim){
-    // Multiblock vertex arbitration
-    double beta = 1./cParams.Tstop();
-    int blockSize = alpaka::getWorkDiv<alpaka::Grid, alpaka::Blocks>(acc)[0u];
+  template <bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void gatherArbitratedVertices(const TAcc& acc, portablevertex::VertexDeviceCollection::View vertices, const clusterizerWorkspace ws){
+    // Multiblock vertex arbitration, first step: one block per clusterizer block writes the vertices it sends to the arbitration, sorted in z, at the start of its ordered list positions
+    // The list of a block is short, so its selected vertices are sorted with a rank sort spread over the threads of the block, ties broken by list position
+    int nThreads  = alpaka::getWorkDiv<alpaka::Block, alpaka::Threads>(acc)[0u]; // Threads per block, 1 on the CPU backends
     int threadIdx = alpaka::getIdx<alpaka::Block, alpaka::Threads>(acc)[0u]; // Thread number inside block
-    auto& z= alpaka::declareSharedVar<float[128], __COUNTER__>(acc);
-    auto& rho= alpaka::declareSharedVar<float[128], __COUNTER__>(acc);
-    alpaka::syncBlockThreads(acc);
-    if (once_per_block(acc)){ 
-      int nTrueVertex = 0;
-      int blockSize = alpaka::getWorkDiv<alpaka::Grid, alpaka::Blocks>(acc)[0u];
-      int maxVerticesPerBlock = (int) 512/blockSize; // Max vertices size is 512 over number of blocks in grid
-      for (int32_t blockid = 0; blockid < griddim ; blockid++){
-        for(int ivtx = blockid * maxVerticesPerBlock; ivtx < blockid * maxVerticesPerBlock + vertices[blockid].nV(); ivtx++){
-          int ivertex = vertices[ivtx].order();
-          if ((vertices[ivertex].rho()< 10000) && (abs(vertices[ivertex].z())<30)) {
-            z[nTrueVertex] = vertices[ivertex].z();
-            rho[nTrueVertex] = vertices[ivertex].rho();
-            nTrueVertex ++;
-            if (nTrueVertex==1024) break;
-          }
-        }
+    int blockIdx  = alpaka::getIdx<alpaka::Grid, alpaka::Blocks>(acc)[0u]; // Block number inside grid
+    int maxVerticesPerBlock = ws.maxVerticesPerBlock; // Capacity of the ordered vertex list of each block
+    int base = maxVerticesPerBlock * blockIdx; // First position of the ordered list of this block
+    int nV = vertices[blockIdx].nV();
+    double* z = ws.orderedZ + base; // The global copy is free once the clusterizer is done, vertices that are not selected get z = +inf
+    double nSelected = 0.;
+    for (int k = threadIdx; k < nV; k += nThreads){
+      int ivertex = ws.order[base + k];
+      bool selected = (vertices[ivertex].rho()< 10000) && (abs(vertices[ivertex].z())<30);
+      selected = selected && (vertices[ivertex].z() >= ws.blockZRange[2*blockIdx]) && (vertices[ivertex].z() < ws.blockZRange[2*blockIdx + 1]); // Vertices in the halo of a block are left to the neighbouring block
+      z[k] = selected ? vertices[ivertex].z() : std::numeric_limits<double>::infinity();
+      if (selected) nSelected += 1.;
+    }
+    nSelected = blockSum(acc, *ws.scratch, nSelected); // Also syncs, so all z are in place
+    for (int k = threadIdx; k < nV; k += nThreads){
+      if (not(std::isfinite(z[k]))) continue; // Not selected
+      int rank = 0;
+      for (int j = 0; j < nV; j++){
+        if ((z[j] < z[k]) || ((z[j] == z[k]) && (j < k))) rank++;
       }
-      vertices[0].nV() = nTrueVertex;
+      ws.arbitrationZ[base + rank]   = z[k];
+      ws.arbitrationRho[base + rank] = vertices[ws.order[base + k]].rho();
     }
-    alpaka::syncBlockThreads(acc);
-
-    auto& orderedIndices = alpaka::declareSharedVar<uint16_t[1024], __COUNTER__>(acc);
-    auto& sws            = alpaka::declareSharedVar<uint16_t[1024], __COUNTER__>(acc);
-    
-    int const& nvFinal = vertices[0].nV();
+    if (once_per_block(acc)){
+      ws.arbitrationCount[blockIdx] = static_cast<int32_t>(nSelected);
+      alpaka::atomicAdd(acc, ws.nArbitrated, static_cast<int32_t>(nSelected), alpaka::hierarchy::Blocks{});
+    }
+  }
 
-    cms::alpakatools::radixSort<Acc1D, float, 2>(acc, z, orderedIndices, sws, nvFinal);
-    alpaka::syncBlockThreads(acc);
-    if (once_per_block(acc)){ 
-      // copy sorted vertices back to the SoA
-      for (int ivtx=threadIdx; ivtx< vertices[0].nV(); ivtx+=blockSize){
-        vertices[ivtx].z() = z[ivtx];
-        vertices[ivtx].rho() = rho[ivtx];
-        vertices[ivtx].order() = orderedIndices[ivtx];
+  template <bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void sortArbitratedVertices(const TAcc& acc, portablevertex::VertexDeviceCollection::View vertices, const clusterizerWorkspace ws, int32_t nBlocks){
+    // Second step, a device-wide merge of the sorted runs of the blocks: the row of a vertex is its index in its own run, plus the number of vertices before it in each other run, found by binary search
+    // Ties go to the lower block, so the rows are the same as with a sort by z and then list position. Threads past the end of a run have nothing to do. Rows end up in z order, so order is the identity
+    int maxVerticesPerBlock = ws.maxVerticesPerBlock; // Capacity of the ordered vertex list of each block
+    for (auto ivertexO : elements_with_stride(acc, nBlocks * maxVerticesPerBlock)){
+      int block = ivertexO / maxVerticesPerBlock;
+      int i = ivertexO - block * maxVerticesPerBlock; // Index in the run of its block
+      if (i >= ws.arbitrationCount[block]) continue;
+      double z = ws.arbitrationZ[ivertexO];
+      int rank = i;
+      for (int other = 0; other < nBlocks; other++){
+        if (other == block) continue;
+        const double* run = ws.arbitrationZ + maxVerticesPerBlock * other;
+        rank += other < block ? upperBound(run, ws.arbitrationCount[other], z) : lowerBound(run, ws.arbitrationCount[other], z);
       }
-    }  
-    alpaka::syncBlockThreads(acc);
+      vertices[rank].z()      = z;
+      vertices[rank].rho()    = ws.arbitrationRho[ivertexO];
+      vertices[rank].order()  = rank;
+      vertices[rank].isGood() = true; // The rows are reused from the pool, whatever was there before is gone
+    }
+    if (once_per_grid(acc)) vertices[0].nV() = *ws.nArbitrated;
+  }
+
+  ALPAKA_FN_ACC static int firstVertexAbove(portablevertex::VertexDeviceCollection::View vertices, int nV, double z){
+    // Binary search in the z-ordered rows: first vertex with z >= the given value, nV if there is none
+    int low = 0;
+    int high = nV;
+    while (low < high){
+      int mid = (low + high) / 2;
+      if (vertices[mid].z() < z) low = mid + 1;
+      else high = mid;
+    }
+    return low;
+  }
+
+  template <bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void assignTracks(const TAcc& acc, const blockTracks tracks, portablevertex::VertexDeviceCollection::View vertices, const ClusterParamsCollection::ConstView cParams){
+    // Third step, one thread per track across the whole grid: find the window of vertices within range with a binary search, then hard-assign the track to the most probable one
+    double beta = 1./cParams.Tstop();
+    int nV = vertices[0].nV();
     double zrange_min_ = 0.1;
-     
-    for (int itrack = threadIdx; itrack < tracks.nT() ; itrack += blockSize){
-      if (not(tracks[itrack].isGood())) continue;
-      double zrange     = std::max(cParams.zrange()/ sqrt((beta) * tracks[itrack].oneoverdz2()), zrange_min_);
-      double zmin       = tracks[itrack].z() - zrange;
-      int kmin = vertices[0].nV()-1;
-      if (vertices[vertices[kmin].order()].z() > zmin){ // vertex properties always accessed through vertices->order
-        while ((kmin > 0) && (vertices[vertices[kmin-1].order()].z() > zmin)) { // i.e., while we find another vertex within range that is before the previous initial step
-          kmin--;
-        }
-      }
-      else {
-        while ((kmin < vertices[0].nV()) && (vertices[vertices[kmin].order()].z() < zmin)) { // Or it might happen that we have to take out vertices from the thing
-          kmin++;
+    double mintrkweight_ = 0.5;
+    double rho0 = nV > 1 ? 1./nV : 1.;
+    double z_sum_init = rho0*exp(-(beta)*cParams.dzCutOff()*cParams.dzCutOff());
+    for (auto itrack : elements_with_stride(acc, tracks.nT())){
+      if (not(tracks.isGood(itrack))) continue;
+      int iMax = 10000;
+      if (nV > 0){
+        double zrange = std::max(cParams.zrange()/ sqrt((beta) * tracks.oneoverdz2(itrack)), zrange_min_);
+        int kmin = firstVertexAbove(vertices, nV, tracks.z(itrack) - zrange);
+        int kmax = firstVertexAbove(vertices, nV, tracks.z(itrack) + zrange); // Always looping to kmax - 1
+        if (kmin >= kmax){ // No vertex within range, take the ones right below and above
+          kmin = std::max(0, kmax - 1);
+          kmax = std::min(nV, kmax + 1);
         }
-      }
-      // Now the same for the upper bound
-      double zmax       = tracks[itrack].z() + zrange;
-      int kmax = 0;
-      if (vertices[vertices[kmax].order()].z()< zmax) {
-        while (( kmax < vertices[0].nV()  - 1) && ( vertices[vertices[kmax+1].order()].z()< zmax )) { // As long as we have more vertex above kmax but within z range, we can add them to the collection, keep going
-          kmax++;
+        double p_max = -1; 
+        double sum_Z = z_sum_init;
+        for (auto k = kmin; k < kmax; k++) {
+          double v_exp = exp(-(beta) * std::pow( tracks.z(itrack) - vertices[k].z(), 2) * tracks.oneoverdz2(itrack));
+          sum_Z += vertices[k].rho() * v_exp;
         }
-      }
-      else { //Or maybe we have to restrict it
-        while (( kmax > 0) && (vertices[vertices[kmax].order()].z() > zmax)) {
-          kmax--;
+        double invZ = sum_Z > 1e-100 ? 1. / sum_Z : 0.0;
+        for (auto k = kmin; k < kmax; k++) {
+          float v_exp = exp(-(beta) * std::pow( tracks.z(itrack) - vertices[k].z(), 2) * tracks.oneoverdz2(itrack)) ;
+          float p = vertices[k].rho() * v_exp * invZ;
+          if (p > p_max && p > mintrkweight_) {
+            // assign  track i -> vertex k (hard, mintrkweight_ should be >= 0.5 here)
+            p_max = p;
+            iMax = k;
+          }
         }
       }
-      if (kmin <= kmax) {
-        tracks[itrack].kmin() = kmin;
-        tracks[itrack].kmax() = kmax + 1; //always looping to tracks->kmax(i) - 1
-      }
-      else { // If it is here, the whole vertex are under
-        tracks[itrack].kmin() = std::max(0, std::min(kmin, kmax));
-        tracks[itrack].kmax() = std::min(vertices[0].nV(), std::max(kmin, kmax) + 1);
-      }
+      tracks.kmin(itrack) = iMax; 
+      tracks.kmax(itrack) = iMax+1; 
     }
-    alpaka::syncBlockThreads(acc); 
+  }
 
-    double mintrkweight_ = 0.5;
-    double rho0 = vertices[0].nV() > 1 ? 1./vertices[0].nV() : 1.;
-    double z_sum_init = rho0*exp(-(beta)*cParams.dzCutOff()*cParams.dzCutOff());
-    for (int itrack = threadIdx; itrack < tracks.nT() ; itrack += blockSize){
-      int kmin = tracks[itrack].kmin();
-      int kmax = tracks[itrack].kmax();
-      double p_max = -1; 
-      int iMax = 10000; 
-      double sum_Z = z_sum_init;
-      for (auto k = kmin; k < kmax; k++) {
-        double v_exp = exp(-(beta) * std::pow( tracks[itrack].z() - vertices[vertices[k].order()].z(), 2) * tracks[itrack].oneoverdz2());
-        sum_Z += vertices[vertices[k].order()].rho() * v_exp;
-      }
-      double invZ = sum_Z > 1e-100 ? 1. / sum_Z : 0.0;
-      for (auto k = kmin; k < kmax; k++) {
-        float v_exp = exp(-(beta) * std::pow( tracks[itrack].z() - vertices[vertices[k].order()].z(), 2) * tracks[itrack].oneoverdz2()) ;
-        float p = vertices[vertices[k].order()].rho() * v_exp * invZ;
-        if (p > p_max && p > mintrkweight_) {
-          // assign  track i -> vertex k (hard, mintrkweight_ should be >= 0.5 here)
-          p_max = p;
-          iMax = k;
-        }
-      }
-      tracks[itrack].kmin() = iMax; 
-      tracks[itrack].kmax() = iMax+1; 
+  ALPAKA_FN_ACC static int assignedVertex(const blockTracks tracks, const clusterizerWorkspace ws, int itrack, int nV){
+    // Position in the arbitrated vertex list of the vertex a track ends up in, or -1 if it is not assigned. Only the owner of each tt_index counts, the other slots holding the track come from overlapping blocks
+    if (not(tracks.isGood(itrack))) return -1;
+    int k  = tracks.kmin(itrack);
+    int tt = tracks.tt_index(itrack);
+    if ((k < 0) || (k >= nV) || (tt < 0) || (tt >= ws.nTrackIndices)) return -1;
+    return ws.trackOwner[tt] == itrack ? k : -1;
+  }
+
+  // Last steps: build the track list of each vertex and keep the good vertices, which are written in z order to the first rows of the collection, as the fitter and the output expect
+  // Counting sort: histogram the tracks per vertex, pick the good vertices and their final rows with a scan, then scatter the tracks. The steps over tracks run over the whole grid, each in its own kernel as they depend on each other
+  // The number of arbitrated vertices is read from ws.nArbitrated, as vertices[0].nV() becomes the number of good ones on the way
+
+  template <bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void prepareFinalVertices(const TAcc& acc, const blockTracks tracks, portablevertex::VertexDeviceCollection::View vertices, const clusterizerWorkspace ws){
+    // Reset the track owners and the per-vertex counters, and keep z and rho of the arbitrated vertices, as their rows get overwritten by the good ones
+    int nV = *ws.nArbitrated;
+    for (auto itt : elements_with_stride(acc, ws.nTrackIndices)){
+      ws.trackOwner[itt] = tracks.nT(); // No owner yet
+    }
+    for (auto k : elements_with_stride(acc, nV)){
+      int ivertex = vertices[k].order();
+      ws.vertexTracks[k]   = 0;
+      ws.vertexFill[k]     = 0;
+      ws.arbitrationZ[k]   = vertices[ivertex].z(); // Free again once the rows are sorted
+      ws.arbitrationRho[k] = vertices[ivertex].rho();
+    }
+  }
+
+  template <bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void claimTrackOwners(const TAcc& acc, const blockTracks tracks, const clusterizerWorkspace ws){
+    // Overlapping blocks have slots for the same track, which end up in the same vertex. Among those slots, the one with the lowest index owns the tt_index, so the choice does not depend on the scheduling
+    int nV = *ws.nArbitrated;
+    for (auto itrack : elements_with_stride(acc, tracks.nT())){
+      if (not(tracks.isGood(itrack))) continue;
+      int k  = tracks.kmin(itrack);
+      int tt = tracks.tt_index(itrack);
+      if ((k < 0) || (k >= nV) || (tt < 0) || (tt >= ws.nTrackIndices)) continue; // Not assigned to any vertex
+      alpaka::atomicMin(acc, &ws.trackOwner[tt], static_cast<int32_t>(itrack), alpaka::hierarchy::Blocks{});
+    }
+  }
+
+  template <bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void countVertexTracks(const TAcc& acc, const blockTracks tracks, const clusterizerWorkspace ws){
+    // Histogram of tracks per vertex. Integer counts, so the atomics do not change the result
+    int nV = *ws.nArbitrated;
+    for (auto itrack : elements_with_stride(acc, tracks.nT())){
+      int k = assignedVertex(tracks, ws, itrack, nV);
+      if (k >= 0) alpaka::atomicAdd(acc, &ws.vertexTracks[k], 1, alpaka::hierarchy::Blocks{});
     }
-    alpaka::syncBlockThreads(acc);
   }
 
-  template <bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void finalizeVertices(const TAcc& acc, portablevertex::TrackDeviceCollection::View tracks, portablevertex::VertexDeviceCollection::View vertices, const portablevertex::ClusterParamsHostCollection::ConstView cParams){
-    int blockSize = alpaka::getWorkDiv<alpaka::Grid, alpaka::Blocks>(acc)[0u];
+  template <bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void selectFinalVertices(const TAcc& acc, portablevertex::VertexDeviceCollection::View vertices, const ClusterParamsCollection::ConstView cParams, const clusterizerWorkspace ws){
+    // Single block: pick the good vertices and give them their final rows with a block scan
+    int nThreads  = alpaka::getWorkDiv<alpaka::Block, alpaka::Threads>(acc)[0u]; // Threads per block, 1 on the CPU backends
     int threadIdx = alpaka::getIdx<alpaka::Block, alpaka::Threads>(acc)[0u]; // Thread number inside block
-    // From here it used to be vertices
+    int32_t* ntracks     = ws.vertexTracks;
+    int32_t* newPosition = ws.finalPosition;
+    double* zFinal       = ws.arbitrationZ;
+    double* rhoFinal     = ws.arbitrationRho;
+    int nV = *ws.nArbitrated;
+    // A vertex is good if it has at least two tracks and is far enough from the previous good one. Each decision depends on the last good vertex before it, so this chain along z is serial, but it is only O(nV) and reads nothing but the counts
     if (once_per_block(acc)){
-    for (int k = 0; k < vertices[0].nV(); k+= 1) { //TODO: ithread, blockSize
-      int ivertex = vertices[k].order();
-      vertices[ivertex].ntracks() = 0;
-      for (int itrack = 0; itrack < tracks.nT(); itrack+= 1){
-        if (not(tracks[itrack].isGood())) continue; // Remove duplicates
-        int ivtxFromTk = tracks[itrack].kmin();
-        if (ivtxFromTk == k){
-	  bool isNew = true;
-	  for (int ivtrack = 0; ivtrack < vertices[ivertex].ntracks(); ivtrack++){
-	    if (tracks[itrack].tt_index() == tracks[vertices[ivertex].track_id()[ivtrack]].tt_index()) isNew = false;
-          }
-	  if (!isNew) continue;
-	  vertices[ivertex].track_id()[vertices[ivertex].ntracks()] = itrack; //tracks[itrack].tt_index();
-	  vertices[ivertex].track_weight()[vertices[ivertex].ntracks()] = 1.;
-  	  vertices[ivertex].ntracks()++;
+      bool firstGood = true;
+      double zPrev = 0.;
+      for (int k = 0; k < nV; k++){
+        bool good = (ntracks[k] >= 2) && (firstGood || (abs(zFinal[k] - zPrev) > (2* cParams.vertexSize())));
+        if (good){
+          firstGood = false;
+          zPrev = zFinal[k];
         }
+        newPosition[k] = good ? 1 : 0;
+      }
+      newPosition[nV] = 0;
+    }
+    alpaka::syncBlockThreads(acc);
+    int nGood = blockExclusiveScan(acc, *ws.scratch, newPosition, nV + 1);
+    // Good vertices go to rows 0..nGood-1 in z order, the rows after them up to the old multiplicity are invalidated
+    for (int k = threadIdx; k < nV; k += nThreads){
+      if (newPosition[k + 1] > newPosition[k]){
+        int ivertex = newPosition[k];
+        vertices[ivertex].z()       = zFinal[k];
+        vertices[ivertex].rho()     = rhoFinal[k];
+        vertices[ivertex].ntracks() = ntracks[k];
+        vertices[ivertex].x()       = 0;
+        vertices[ivertex].y()       = 0;
+        vertices[ivertex].order()   = ivertex;
+        vertices[ivertex].isGood()  = true;
       }
-      if (vertices[ivertex].ntracks() < 2){
-        vertices[ivertex].isGood() = false; // No longer needed
-        continue; //Skip vertex if it has no tracks
+      else{
+        vertices[nGood + k - newPosition[k]].isGood() = false;
       }
-      vertices[ivertex].x() = 0;
-      vertices[ivertex].y() = 0;
     }
+    if (once_per_block(acc)){
+      vertices[0].nV() = nGood;
     }
     alpaka::syncBlockThreads(acc);
-    if (once_per_block(acc)){
-      // So we now check whether each vertex is further enough from the previous one
-      for (int k = 0; k < vertices[0].nV(); k++) {
-        int prevVertex = ((int) k)-1;
-        int thisVertex = (int) vertices[k].order();
-        if (not(vertices[thisVertex].isGood())){
-          continue;
-        }
-        while (!(vertices[vertices[prevVertex].order()].isGood()) && prevVertex >= 0){
-          // Find the previous vertex that was good
-          prevVertex--;
-        }
-        if ((prevVertex < 0)){ // If it is first, always good
-          vertices[thisVertex].isGood() = true;
-        }
-        else if (abs(vertices[thisVertex].z()-vertices[prevVertex].z()) > (2* cParams.vertexSize())){ //If it is further away enough, it is also good
-          vertices[thisVertex].isGood() = true;
-        }
-        else{
-          vertices[thisVertex].isGood() = false;
-        }
-      }
-      // This is new, basically we have to deal with the order being broken by the invalidation of vertexes and set back again the vertex multiplicity, unfortunately can't be parallelized without competing conditions
-      int k = 0;
-      while (k != vertices[0].nV()){
-        int thisVertex = vertices[k].order();
-        if (vertices[thisVertex].isGood()){ // If is good just continue
-          k++;
-        }
-        else{
-          for (int l = k ; l < vertices[0].nV() ; l++){ //If it is bad, move one position all indexes
-  	    vertices[l].order() = vertices[l+1].order();
-  	  }
-          vertices[0].nV()--; // And reduce vertex number by 1
+  }
+
+  template <bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void fillVertexTracks(const TAcc& acc, const blockTracks tracks, portablevertex::VertexDeviceCollection::View vertices, const clusterizerWorkspace ws){
+    // Scatter the tracks into the lists of the good vertices
+    int nV = *ws.nArbitrated;
+    for (auto itrack : elements_with_stride(acc, tracks.nT())){
+      int k = assignedVertex(tracks, ws, itrack, nV);
+      if ((k < 0) || (ws.finalPosition[k + 1] == ws.finalPosition[k])) continue;
+      int ivertex = ws.finalPosition[k];
+      int slot = alpaka::atomicAdd(acc, &ws.vertexFill[k], 1, alpaka::hierarchy::Blocks{});
+      vertices[ivertex].track_id()[slot] = tracks.inputIndex(itrack); // Row of the input track collection, which the fitter reads
+      vertices[ivertex].track_weight()[slot] = 1.;
+    }
+  }
+
+  template <bool debug = false, typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>> ALPAKA_FN_ACC static void sortVertexTracks(const TAcc& acc, portablevertex::VertexDeviceCollection::View vertices){
+    // The scatter order depends on the scheduling, sort each list so the fit always adds up the tracks in the same order. One thread per good vertex
+    for (auto ivertex : elements_with_stride(acc, vertices[0].nV())){
+      for (int i = 1; i < vertices[ivertex].ntracks(); i++){
+        int itrack = vertices[ivertex].track_id()[i];
+        int j = i - 1;
+        while ((j >= 0) && (vertices[ivertex].track_id()[j] > itrack)){
+          vertices[ivertex].track_id()[j + 1] = vertices[ivertex].track_id()[j];
+          j--;
         }
+        vertices[ivertex].track_id()[j + 1] = itrack;
       }
     }
-    alpaka::syncBlockThreads(acc);
   }
 
+  template <int32_t convergenceMode>
   class clusterizeKernel {
   public:
     template <typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>>
-    ALPAKA_FN_ACC void operator()(const TAcc& acc,  portablevertex::TrackDeviceCollection::View tracks, portablevertex::VertexDeviceCollection::View vertices, const portablevertex::ClusterParamsHostCollection::ConstView cParams) const{ 
+    ALPAKA_FN_ACC void operator()(const TAcc& acc,  const blockTracks deviceTracks, portablevertex::VertexDeviceCollection::View vertices, const ClusterParamsCollection::ConstView cParams, const clusterizerWorkspace deviceWs) const{ 
       // This has the core of the clusterization algorithm
-      // First, declare beta=1/T
-      initialize(acc, tracks, vertices, cParams);
-      int blockSize = alpaka::getWorkDiv<alpaka::Grid, alpaka::Blocks>(acc)[0u];
+      int blockSize = deviceWs.blockSize; // Tracks per block
+      int nThreads  = alpaka::getWorkDiv<alpaka::Block, alpaka::Threads>(acc)[0u]; // Threads per block, 1 on the CPU backends
       int threadIdx = alpaka::getIdx<alpaka::Block, alpaka::Threads>(acc)[0u]; // Thread number inside block
       int blockIdx  = alpaka::getIdx<alpaka::Grid, alpaka::Blocks>(acc)[0u]; // Block number inside grid
 
+      // Stage the hot columns of the block tracks and the z of its ordered vertex list in block shared memory, as the annealing reads them on every iteration
+      // The track columns never change and the vertex z are only used inside this kernel, so nothing has to be written back. Without enough shared memory, the same code works on the device arrays
+      blockTracks tracks = deviceTracks;
+      clusterizerWorkspace ws = deviceWs;
+      ws.scratch = &alpaka::declareSharedVar<blockScratch, __COUNTER__>(acc);
+      if (clusterizerWorkspace::stagingSize(blockSize, ws.maxVerticesPerBlock) > 0){
+        double* staged = alpaka::getDynSharedMem<double>(acc);
+        for (int i = threadIdx; i < blockSize; i += nThreads){
+          int itrack = blockIdx*blockSize + i;
+          staged[i]               = deviceTracks.z(itrack);
+          staged[blockSize + i]   = deviceTracks.weight(itrack);
+          staged[2*blockSize + i] = deviceTracks.oneoverdz2(itrack);
+        }
+        tracks = deviceTracks.staged(staged, staged + blockSize, staged + 2*blockSize, blockIdx*blockSize);
+        ws.orderedZ = staged + 3*blockSize;
+        alpaka::syncBlockThreads(acc);
+      }
+      else ws.orderedZ = deviceWs.orderedZ + ws.maxVerticesPerBlock*blockIdx;
+
+      // First, declare beta=1/T
       double& _beta = alpaka::declareSharedVar<double, __COUNTER__>(acc);
       double& osumtkwt = alpaka::declareSharedVar<double, __COUNTER__>(acc);
-      for (int itrack = threadIdx+blockIdx*blockSize; itrack < threadIdx+(blockIdx+1)*blockSize ; itrack += blockSize){ // TODO:Saving and reading in the tracks dataformat might be a bit too much?
-        alpaka::atomicAdd(acc, &osumtkwt, tracks[itrack].weight(), alpaka::hierarchy::Threads{});
+      double sumtkwt = 0.;
+      for (int itrack = threadIdx+blockIdx*blockSize; itrack < (blockIdx+1)*blockSize ; itrack += nThreads){ // TODO:Saving and reading in the tracks dataformat might be a bit too much?
+        sumtkwt += tracks.weight(itrack);
+      }
+      sumtkwt = blockSum(acc, *ws.scratch, sumtkwt);
+      if (once_per_block(acc)){
+        osumtkwt = sumtkwt > 0 ? 1./sumtkwt : 0.; // Inverse of the total track weight, which normalizes the vertex masses in update
       }
       alpaka::syncBlockThreads(acc);
+      if (not(sumtkwt > 0)){ // A block left without tracks by the partitioning, there is nothing to cluster
+        if (once_per_block(acc)){
+          vertices[blockIdx].nV() = 0;
+          ws.coolingSteps[blockIdx] = 0;
+        }
+        return;
+      }
       // In each block, initialize to a single vertex with all tracks
-      initialize(acc, tracks, vertices, cParams);
+      initialize(acc, tracks, vertices, cParams, ws);
       alpaka::syncBlockThreads(acc);
-      // First estimation of critical temperature
-      getBeta0(acc, tracks, vertices, cParams, _beta);
+      // First estimation of critical temperature, either of the single vertex or of the clusters seeded from the track histogram
+      bool seeded = (ws.seedingMode == seedingHistogram) && seedFromHistogram(acc, tracks, vertices, cParams, ws, _beta);
+      if (not seeded) getBeta0(acc, tracks, vertices, cParams, ws, _beta);
       alpaka::syncBlockThreads(acc);
       // Cool down to beta0 with rho = 0.0 (no regularization term)
-      thermalize(acc, tracks, vertices, cParams, osumtkwt, _beta, cParams.delta_highT(), 0.0);
+      thermalize<convergenceMode>(acc, tracks, vertices, cParams, ws, osumtkwt, _beta, cParams.delta_highT(), 0.0);
       alpaka::syncBlockThreads(acc);
       // Now the cooling loop
-      coolingWhileSplitting(acc, tracks, vertices, cParams, osumtkwt, _beta);
+      coolingWhileSplitting<convergenceMode>(acc, tracks, vertices, cParams, ws, osumtkwt, _beta);
       alpaka::syncBlockThreads(acc);
       // After cooling, merge closeby vertices
-      reMergeTracks(acc,tracks, vertices,cParams, osumtkwt, _beta);
+      reMergeTracks(acc, tracks, vertices, cParams, ws, osumtkwt, _beta);
       alpaka::syncBlockThreads(acc);
       // And split those with tension
-      reSplitTracks(acc,tracks, vertices,cParams, osumtkwt, _beta);
+      reSplitTracks<convergenceMode>(acc, tracks, vertices, cParams, ws, osumtkwt, _beta);
       alpaka::syncBlockThreads(acc);
       // After splitting we might get some candidates that are very low quality/have very far away tracks
-      rejectOutliers(acc,tracks, vertices,cParams, osumtkwt, _beta);
+      rejectOutliers<convergenceMode>(acc, tracks, vertices, cParams, ws, osumtkwt, _beta);
       alpaka::syncBlockThreads(acc);
     }
   }; // class kernel
 
+} // namespace ALPAKA_ACCELERATOR_NAMESPACE
 
-  class arbitrateKernel {
+namespace alpaka::trait {
+  // Block shared memory for the staged copies of clusterizeKernel, sized from the workspace it is launched with
+  template <int32_t convergenceMode, typename TAcc>
+  struct BlockSharedMemDynSizeBytes<ALPAKA_ACCELERATOR_NAMESPACE::clusterizeKernel<convergenceMode>, TAcc> {
+    template <typename TVec, typename TTracks, typename TVertices, typename TParams>
+    ALPAKA_FN_HOST_ACC static std::size_t getBlockSharedMemDynSizeBytes(ALPAKA_ACCELERATOR_NAMESPACE::clusterizeKernel<convergenceMode> const&, TVec const&, TVec const&, TTracks const&, TVertices const&, TParams const&, ALPAKA_ACCELERATOR_NAMESPACE::clusterizerWorkspace const& ws){
+      return ALPAKA_ACCELERATOR_NAMESPACE::clusterizerWorkspace::stagingSize(ws.blockSize, ws.maxVerticesPerBlock) * sizeof(double);
+    }
+  };
+} // namespace alpaka::trait
+
+namespace ALPAKA_ACCELERATOR_NAMESPACE {
+
+  class gatherArbitrationKernel {
   public:
     template <typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>>
-    ALPAKA_FN_ACC void operator()(const TAcc& acc,  portablevertex::TrackDeviceCollection::View tracks, portablevertex::VertexDeviceCollection::View vertices, const portablevertex::ClusterParamsHostCollection::ConstView cParams, int32_t nBlocks) const{
-      // This has the core of the clusterization algorithm
-      resortVerticesAndAssign(acc, tracks, vertices,cParams, nBlocks);
-      alpaka::syncBlockThreads(acc);
-      finalizeVertices(acc, tracks, vertices, cParams); // In CUDA it used to be verticesAndClusterize
-      alpaka::syncBlockThreads(acc);
-    }       
+    ALPAKA_FN_ACC void operator()(const TAcc& acc, portablevertex::VertexDeviceCollection::View vertices, const clusterizerWorkspace deviceWs) const{
+      clusterizerWorkspace ws = deviceWs;
+      ws.scratch = &alpaka::declareSharedVar<blockScratch, __COUNTER__>(acc);
+      gatherArbitratedVertices(acc, vertices, ws);
+    }
+  }; // class kernel
+
+  class sortArbitrationKernel {
+  public:
+    template <typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>>
+    ALPAKA_FN_ACC void operator()(const TAcc& acc, portablevertex::VertexDeviceCollection::View vertices, const clusterizerWorkspace ws, int32_t nBlocks) const{
+      sortArbitratedVertices(acc, vertices, ws, nBlocks);
+    }
+  }; // class kernel
+
+  class assignTracksKernel {
+  public:
+    template <typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>>
+    ALPAKA_FN_ACC void operator()(const TAcc& acc,  const blockTracks tracks, portablevertex::VertexDeviceCollection::View vertices, const ClusterParamsCollection::ConstView cParams) const{
+      assignTracks(acc, tracks, vertices, cParams);
+    }
+  }; // class kernel
+
+  class prepareFinalizeKernel {
+  public:
+    template <typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>>
+    ALPAKA_FN_ACC void operator()(const TAcc& acc,  const blockTracks tracks, portablevertex::VertexDeviceCollection::View vertices, const clusterizerWorkspace ws) const{
+      prepareFinalVertices(acc, tracks, vertices, ws);
+    }
+  }; // class kernel
+
+  class claimTracksKernel {
+  public:
+    template <typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>>
+    ALPAKA_FN_ACC void operator()(const TAcc& acc,  const blockTracks tracks, const clusterizerWorkspace ws) const{
+      claimTrackOwners(acc, tracks, ws);
+    }
+  }; // class kernel
+
+  class countTracksKernel {
+  public:
+    template <typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>>
+    ALPAKA_FN_ACC void operator()(const TAcc& acc,  const blockTracks tracks, const clusterizerWorkspace ws) const{
+      countVertexTracks(acc, tracks, ws);
+    }
+  }; // class kernel
+
+  class selectVerticesKernel {
+  public:
+    template <typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>>
+    ALPAKA_FN_ACC void operator()(const TAcc& acc, portablevertex::VertexDeviceCollection::View vertices, const ClusterParamsCollection::ConstView cParams, const clusterizerWorkspace deviceWs) const{
+      clusterizerWorkspace ws = deviceWs;
+      ws.scratch = &alpaka::declareSharedVar<blockScratch, __COUNTER__>(acc);
+      selectFinalVertices(acc, vertices, cParams, ws);
+    }
+  }; // class kernel
+
+  class fillTracksKernel {
+  public:
+    template <typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>>
+    ALPAKA_FN_ACC void operator()(const TAcc& acc,  const blockTracks tracks, portablevertex::VertexDeviceCollection::View vertices, const clusterizerWorkspace ws) const{
+      fillVertexTracks(acc, tracks, vertices, ws);
+    }
+  }; // class kernel
+
+  class sortTracksKernel {
+  public:
+    template <typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>>
+    ALPAKA_FN_ACC void operator()(const TAcc& acc, portablevertex::VertexDeviceCollection::View vertices) const{
+      sortVertexTracks(acc, vertices);
+    }
   }; // class kernel
 
 
-  ClusterizerAlgo::ClusterizerAlgo(Queue& queue) {
+  ClusterizerAlgo::ClusterizerAlgo(int32_t convergenceMode) : convergenceMode_(convergenceMode) {
   } // ClusterizerAlgo::ClusterizerAlgo
   
-  void ClusterizerAlgo::clusterize(Queue& queue, portablevertex::TrackDeviceCollection& deviceTrack, portablevertex::VertexDeviceCollection& deviceVertex, const std::shared_ptr<portablevertex::ClusterParamsHostCollection> cParams, int32_t nBlocks, int32_t blockSize){
-    const int blocks = divide_up_by(nBlocks*blockSize, blockSize); //nBlocks of size blockSize
-    alpaka::exec<Acc1D>(queue,
-		        make_workdiv<Acc1D>(blocks, blockSize),
-			clusterizeKernel{},
-			deviceTrack.view(), // TODO:: Maybe we can optimize the compiler by not making this const? Tracks would not be modified
-			deviceVertex.view(),
-			cParams->view());
+  void ClusterizerAlgo::clusterize(Queue& queue, const portablevertex::TrackDeviceCollection& deviceTrack, portablevertex::VertexDeviceCollection& deviceVertex, const ClusterParamsCollection& cParams, int32_t nBlocks, const clusterizerWorkspace& ws){
+    const int blocks = divide_up_by(nBlocks*ws.blockSize, ws.blockSize); //nBlocks of size blockSize
+    auto launch = [&](auto kernel){
+      alpaka::exec<Acc1D>(queue,
+		          make_workdiv<Acc1D>(blocks, ws.blockSize),
+			  kernel,
+			  blockTracks::view(deviceTrack.view(), ws, nBlocks),
+			  deviceVertex.view(),
+			  cParams.const_view(),
+			  ws);
+    };
+    if (convergenceMode_ == convergenceTemperatureScaled) launch(clusterizeKernel<convergenceTemperatureScaled>{});
+    else launch(clusterizeKernel<convergenceFixed>{});
   } // ClusterizerAlgo::clusterize
 
-  void ClusterizerAlgo::arbitrate(Queue& queue, portablevertex::TrackDeviceCollection& deviceTrack, portablevertex::VertexDeviceCollection& deviceVertex, const std::shared_ptr<portablevertex::ClusterParamsHostCollection> cParams, int32_t nBlocks, int32_t blockSize){
-    const int blocks = divide_up_by(blockSize, blockSize); //Single block, as it has to converge to a single collection
+  void ClusterizerAlgo::arbitrate(Queue& queue, const portablevertex::TrackDeviceCollection& deviceTrack, portablevertex::VertexDeviceCollection& deviceVertex, const ClusterParamsCollection& cParams, int32_t nBlocks, const clusterizerWorkspace& ws){
+    // Each step is its own kernel sized to its work, the queue orders them
+    const int nPositions = nBlocks*ws.maxVerticesPerBlock; // All the ordered list positions of the clusterizer
+    alpaka::exec<Acc1D>(queue,
+                        make_workdiv<Acc1D>(nBlocks, ws.blockSize), // One block per clusterizer block
+                        gatherArbitrationKernel{},
+                        deviceVertex.view(),
+                        ws);
+    alpaka::exec<Acc1D>(queue,
+                        make_workdiv<Acc1D>(divide_up_by(nPositions, ws.blockSize), ws.blockSize), // One thread per list position, those past the end of the run of their block are idle
+                        sortArbitrationKernel{},
+                        deviceVertex.view(),
+                        ws,
+                        nBlocks);
     alpaka::exec<Acc1D>(queue,
-                        make_workdiv<Acc1D>(blocks, blockSize),
-                        arbitrateKernel{},
-                        deviceTrack.view(), // TODO:: Maybe we can optimize the compiler by not making this const? Tracks would not be modified
+                        make_workdiv<Acc1D>(nBlocks, ws.blockSize), // As many threads as track slots
+                        assignTracksKernel{},
+                        blockTracks::view(deviceTrack.view(), ws, nBlocks),
                         deviceVertex.view(),
-                        cParams->view(),
-			nBlocks);    
+                        cParams.const_view());
+    // Finalize: the steps over tracks use the whole grid, only the choice of the good vertices runs in a single block
+    alpaka::exec<Acc1D>(queue,
+                        make_workdiv<Acc1D>(divide_up_by(std::max(ws.nTrackIndices, nPositions), ws.blockSize), ws.blockSize),
+                        prepareFinalizeKernel{},
+                        blockTracks::view(deviceTrack.view(), ws, nBlocks),
+                        deviceVertex.view(),
+                        ws);
+    alpaka::exec<Acc1D>(queue,
+                        make_workdiv<Acc1D>(nBlocks, ws.blockSize),
+                        claimTracksKernel{},
+                        blockTracks::view(deviceTrack.view(), ws, nBlocks),
+                        ws);
+    alpaka::exec<Acc1D>(queue,
+                        make_workdiv<Acc1D>(nBlocks, ws.blockSize),
+                        countTracksKernel{},
+                        blockTracks::view(deviceTrack.view(), ws, nBlocks),
+                        ws);
+    alpaka::exec<Acc1D>(queue,
+                        make_workdiv<Acc1D>(1, ws.blockSize), // Single block, as the final rows come from a block scan
+                        selectVerticesKernel{},
+                        deviceVertex.view(),
+                        cParams.const_view(),
+                        ws);
+    alpaka::exec<Acc1D>(queue,
+                        make_workdiv<Acc1D>(nBlocks, ws.blockSize),
+                        fillTracksKernel{},
+                        blockTracks::view(deviceTrack.view(), ws, nBlocks),
+                        deviceVertex.view(),
+                        ws);
+    alpaka::exec<Acc1D>(queue,
+                        make_workdiv<Acc1D>(divide_up_by(nPositions, ws.blockSize), ws.blockSize), // One thread per good vertex, there are at most as many as list positions
+                        sortTracksKernel{},
+                        deviceVertex.view());
   } // arbitraterAlgo::arbitrate
 
 } // namespace ALPAKA_ACCELERATOR_NAMESPACE
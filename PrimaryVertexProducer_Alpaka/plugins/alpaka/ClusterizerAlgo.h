@@ -1,11 +1,21 @@
 #ifndef RecoVertex_PrimaryVertexProducer_Alpaka_plugins_alpaka_ClusterizerAlgo_h
 #define RecoVertex_PrimaryVertexProducer_Alpaka_plugins_alpaka_ClusterizerAlgo_h
 
+#include <algorithm>
+
+#include <alpaka/alpaka.hpp>
+
+#include "DataFormats/Portable/interface/alpaka/PortableCollection.h"
 #include "DataFormats/PortableVertex/interface/alpaka/VertexDeviceCollection.h"
 #include "HeterogeneousCore/AlpakaInterface/interface/config.h"
 
+#include "RecoVertex/PrimaryVertexProducer_Alpaka/plugins/alpaka/BlockPrimitives.h"
+
 namespace ALPAKA_ACCELERATOR_NAMESPACE {
 
+  // The cluster parameters in the memory of the device the kernels run on. The producer fills them on the host and copies them over once
+  using ClusterParamsCollection = PortableCollection<portablevertex::ClusterParamsHostCollection::Layout>;
+
   struct clusterParameters {
       double Tmin;
       double Tpurge;
@@ -21,14 +31,165 @@ namespace ALPAKA_ACCELERATOR_NAMESPACE {
       int32_t convergence_mode;
       double delta_lowT;
       double delta_highT;
+      int32_t seeding_mode;
+      double seed_binSize;
+      double seed_minWeight;
+      int32_t cooling_mode;
+      double cooling_minFactor;
+      int32_t cooling_quietIterations;
+  };
+
+  // When thermalize considers the vertex positions stable. The kernels are compiled for each mode, see ClusterizerAlgo::clusterize
+  enum clusterConvergenceModes : int32_t {
+    convergenceFixed = 0,            // Largest vertex movement below delta_highT
+    convergenceTemperatureScaled = 1 // Largest vertex movement below delta_lowT/sqrt(beta), i.e. tighter as the temperature goes down
+  };
+
+  // How each block gets its first vertices before the cooling
+  enum clusterSeedingModes : int32_t {
+    seedingSingleVertex = 0, // One vertex with all tracks, at the critical temperature of the block
+    seedingHistogram = 1     // One vertex per peak of the weighted z histogram of the tracks, at the highest critical temperature of those clusters
+  };
+
+  // How coolingWhileSplitting steps the temperature down to Tmin
+  enum clusterCoolingModes : int32_t {
+    coolingFixed = 0,   // beta is divided by coolingFactor on every step
+    coolingAdaptive = 1 // Larger steps while nothing splits and thermalize converges quickly, smaller ones while vertices split
+  };
+
+  // Bits of the overflow flag, set on device when some vertices had to be dropped for lack of room
+  enum vertexOverflowFlags : int32_t {
+    overflowClusterizer = 1 // A block wanted to split a vertex but all its vertex slots were in use
+  };
+
+  constexpr int maxSpanTerms = 6; // Largest number of per-vertex sums done at once over the track spans, see clusterizerWorkspace::spanSums
+
+  constexpr int maxSeedBins = 1024; // Largest number of bins of the seeding histogram, sets the size of its shared storage
+
+  constexpr int maxSharedBytes = 48 * 1024; // Block shared memory all backends offer without opting in
+  // Static shared memory of clusterizeKernel: the block scratch, the seeding histogram and its peak ranks, and a few shared scalars with room for their alignment
+  constexpr int clusterizerStaticSharedBytes = sizeof(blockScratch) + maxSeedBins * sizeof(double) + (maxSeedBins + 1) * sizeof(int32_t) + 16 * sizeof(double);
+  constexpr int maxStagingBytes = maxSharedBytes - clusterizerStaticSharedBytes; // Block shared memory clusterizeKernel may take for its staged copies on top of the static one
+  static_assert(maxStagingBytes > 0, "The static shared memory of clusterizeKernel leaves no room for the staged copies");
+
+  // Per-event sizes and device scratch of the clusterizer, passed by value to the kernels
+  // Vertex slots in the vertex collection are a pool shared by all blocks: a block takes slots on demand from a global bump
+  // counter, and the slots it frees (merge, purge) go to a per-block free list where its next splits pick them up first
+  struct clusterizerWorkspace {
+    int32_t blockSize;           // Tracks per block
+    int32_t maxVerticesPerBlock; // Capacity of the z-ordered vertex list (and of the free list) of each block
+    int32_t maxVertices;         // Total size of the vertex collection, i.e. of the pool
+    int32_t nTrackIndices;       // Size of the input track collection, the bound on tt_index
+    int32_t* overflow;           // Device flag made of vertexOverflowFlags bits
+    int32_t* order;              // Per-block z-ordered lists of vertex slots, maxVerticesPerBlock entries per block
+    int32_t* freeSlots;          // Per-block stacks of vertex slots returned to the pool, maxVerticesPerBlock entries per block
+    int32_t* nFreeSlots;         // Per-block size of the freeSlots stack
+    int32_t* poolTop;            // First vertex slot never handed out, shared by all blocks
+    int32_t* firstTrack;         // Per ordered list position, first track whose [kmin, kmax) window may contain it, no track before it does
+    int32_t* lastTrack;          // Per ordered list position, last track whose [kmin, kmax) window may contain it, no track after it does
+    int32_t* positionMap;        // Per-block flags of the ordered list positions to keep (or to pick), turned into their new positions by a block scan, maxVerticesPerBlock+1 entries per block
+    int32_t* orderScratch;       // Per-block staging area for the compaction of the ordered list, maxVerticesPerBlock entries per block
+    int32_t* newSlots;           // Per-block vertex slots taken for the splits of a round, maxVerticesPerBlock entries per block
+    int32_t* trackVertexOffset;  // Per track, start of its window in trackVertexExp or -1 if it did not fit
+    int32_t* trackOwner;         // Per tt_index, the copy of the track that is kept when building the vertex track lists, nTrackIndices entries
+    int32_t* nArbitrated;        // Number of vertices that go into the arbitration
+    int32_t* arbitrationCount;   // Per block, number of vertices it sends to the arbitration, the length of its run in arbitrationZ
+    int32_t* vertexTracks;       // Per arbitrated vertex, number of tracks assigned to it, maxVertices entries
+    int32_t* vertexFill;         // Per arbitrated vertex, fill level of its track list, maxVertices entries
+    int32_t* finalPosition;      // Per arbitrated vertex, good flag and then final row, maxVertices+1 entries
+    int32_t* coolingSteps;       // Per block, number of temperature steps taken by coolingWhileSplitting
+    int32_t* blockTrackStart;    // Per block, input track in its first slot, written by BlockAlgo
+    int32_t* blockTrackCount;    // Per block, number of slots that hold input tracks, the others are padding. Written by BlockAlgo
+    int32_t* trackKmin;          // Per track slot, first ordered list position of the window of the track (then the arbitrated vertex it is assigned to)
+    int32_t* trackKmax;          // Per track slot, one past the last position of the window
+    int32_t* spanOffset;         // Per-block start of the (vertex, track) pairs of each ordered list position in the span sums, maxVerticesPerBlock+1 entries per block
+    int32_t* trackKmaxPrefix;    // Per track slot, largest kmax of the tracks of the block up to it, to find the span starts by binary search
+    int32_t* trackKminSuffix;    // Per track slot, minus the smallest kmin of the tracks of the block from it on, stored in reverse track order so that it does not decrease either
+    int32_t trackVertexCapacity; // Size of the track-vertex storage of each block
+    double expCacheTolerance;    // Largest change of the exponent -beta*(z_t-z_v)^2/dz^2 for which a stored track-vertex term is reused instead of recomputed, 0 to always recompute
+    double* trackVertexExp;      // Per-block storage of the track-vertex terms, only the [kmin, kmax) window of each track is kept
+    double* trackVertexArg;      // Exponent each stored term was computed with, same layout as trackVertexExp, nullptr if expCacheTolerance is 0
+    double* splitHalves;         // Per ordered list position, z and rho of the lower and upper halves of a split, 4 entries per position
+    double* orderedZ;            // Per ordered list position, z of the vertex there, kept current so the window searches do not go through order, nBlocks*maxVerticesPerBlock entries
+                                 // clusterizeKernel passes its device functions a workspace where it points to the list of the block itself, indexed from 0, in block shared memory when it fits
+    double* arbitrationZ;        // Per block, z of the vertices it sends to the arbitration, sorted, at the start of its ordered list positions. nBlocks*maxVerticesPerBlock entries, reused for the arbitrated vertices by finalize
+    double* arbitrationRho;      // Same for rho
+    double* blockZRange;         // Per block, the [2*b, 2*b+1) z range whose vertices the block sends to the arbitration, written by BlockAlgo
+    double* trackZ;              // Per track slot, z of the input track, written by BlockAlgo. Padding repeats the last track of the block
+    double* trackWeight;         // Per track slot, weight of the input track, 0 for padding. Written by BlockAlgo
+    double* trackOneOverDz2;     // Per track slot, oneoverdz2 of the input track, 0 for padding. Written by BlockAlgo
+    double* trackSumZ;           // Per track slot, partition function of the track
+    double* trackAux1;           // Per track slot, temporary
+    double* trackAux2;           // Per track slot, temporary
+    double* spanSums;            // Per ordered list position, sums over the tracks of its span, maxSpanTerms entries per position
+    int32_t seedingMode;         // clusterSeedingModes value, the seeding options are not in the ClusterParams SoA so they come with the workspace
+    double seedBinSize;          // Bin width of the seeding histogram
+    double seedMinWeight;        // Smallest summed track weight of a histogram peak to seed a vertex
+    int32_t coolingMode;         // clusterCoolingModes value, also set by the caller
+    double coolingMinFactor;     // Smallest cooling factor, i.e. largest temperature step, of the adaptive mode
+    int32_t coolingQuietIterations; // In the adaptive mode, steps without splits whose thermalize took at most this many iterations make the next step larger
+    blockScratch* scratch;       // Block shared scratch of the BlockPrimitives calls, declared by each kernel in its own copy of the workspace, nullptr on the host
+    static int32_t scratchSize(int32_t nBlocks, int32_t blockSize, int32_t maxVerticesPerBlock, int32_t maxVertices, int32_t nTrackIndices) { return 8*nBlocks*maxVerticesPerBlock + 7*nBlocks + 2 + 5*nBlocks*blockSize + nTrackIndices + 3*maxVertices + 1; } // int32_t needed by the arrays above
+    ALPAKA_FN_HOST_ACC static int32_t stagingSize(int32_t blockSize, int32_t maxVerticesPerBlock) { int32_t size = 3*blockSize + maxVerticesPerBlock; return size * static_cast<int32_t>(sizeof(double)) <= maxStagingBytes ? size : 0; } // double of block shared memory for the staged track columns and vertex z, 0 if they do not fit
+    static int32_t doubleScratchSize(int32_t nBlocks, int32_t blockSize, int32_t maxVerticesPerBlock, int32_t trackVertexCapacity, double expCacheTolerance) { return (expCacheTolerance > 0 ? 2 : 1)*nBlocks*trackVertexCapacity + (7 + maxSpanTerms)*nBlocks*maxVerticesPerBlock + 2*nBlocks + 6*nBlocks*blockSize; } // double needed by the arrays above
+  };
+
+  // The tracks of the clusterizer blocks, as index ranges over the input collection instead of copies of it
+  // Slot i of block b (track slot b*blockSize + i) is input track blockTrackStart[b] + i, and the slots past blockTrackCount[b] are padding that does not contribute
+  // The input is only read, the annealing state of each slot lives in the workspace, so a track shared by two blocks has its own state in each
+  // z, weight and oneoverdz2, read on every annealing iteration, come from contiguous per-slot copies made by BlockAlgo, which clusterizeKernel stages again in block shared memory. The other input columns are only read through inputIndex
+  struct blockTracks {
+    portablevertex::TrackDeviceCollection::ConstView input;
+    int32_t blockSize;
+    int32_t nSlots; // nBlocks*blockSize
+    const int32_t* blockTrackStart;
+    const int32_t* blockTrackCount;
+    const double* trackZ;
+    const double* trackWeight;
+    const double* trackOneOverDz2;
+    int32_t hotFirstSlot; // Slot stored at index 0 of trackZ, trackWeight and trackOneOverDz2: 0 for the workspace arrays, the first slot of the block for staged copies
+    int32_t* trackKmin;
+    int32_t* trackKmax;
+    double* trackSumZ;
+    double* trackAux1;
+    double* trackAux2;
+
+    static blockTracks view(portablevertex::TrackDeviceCollection::ConstView input, const clusterizerWorkspace& ws, int32_t nBlocks){
+      return {input, ws.blockSize, nBlocks * ws.blockSize, ws.blockTrackStart, ws.blockTrackCount, ws.trackZ, ws.trackWeight, ws.trackOneOverDz2, 0, ws.trackKmin, ws.trackKmax, ws.trackSumZ, ws.trackAux1, ws.trackAux2};
+    }
+    ALPAKA_FN_ACC blockTracks staged(const double* z, const double* weight, const double* oneoverdz2, int32_t firstSlot) const { // Same tracks, with the hot columns of the slots from firstSlot on read from the given copies
+      blockTracks copy = *this;
+      copy.trackZ = z;
+      copy.trackWeight = weight;
+      copy.trackOneOverDz2 = oneoverdz2;
+      copy.hotFirstSlot = firstSlot;
+      return copy;
+    }
+    ALPAKA_FN_ACC int32_t nT() const { return nSlots; }
+    ALPAKA_FN_ACC int32_t inputIndex(int32_t slot) const { // Input track in this slot, or -1 for padding
+      int32_t block = slot / blockSize;
+      int32_t i = slot - block * blockSize;
+      return i < blockTrackCount[block] ? blockTrackStart[block] + i : -1;
+    }
+    ALPAKA_FN_ACC double z(int32_t slot) const { return trackZ[slot - hotFirstSlot]; } // Padding repeats the last track of the block, so z stays sorted inside the block
+    ALPAKA_FN_ACC double weight(int32_t slot) const { return trackWeight[slot - hotFirstSlot]; }
+    ALPAKA_FN_ACC double oneoverdz2(int32_t slot) const { return trackOneOverDz2[slot - hotFirstSlot]; }
+    ALPAKA_FN_ACC int32_t tt_index(int32_t slot) const { int32_t i = inputIndex(slot); return i >= 0 ? input[i].tt_index() : -1; }
+    ALPAKA_FN_ACC bool isGood(int32_t slot) const { int32_t i = inputIndex(slot); return i >= 0 ? input[i].isGood() : false; }
+    ALPAKA_FN_ACC int32_t& kmin(int32_t slot) const { return trackKmin[slot]; }
+    ALPAKA_FN_ACC int32_t& kmax(int32_t slot) const { return trackKmax[slot]; }
+    ALPAKA_FN_ACC double& sum_Z(int32_t slot) const { return trackSumZ[slot]; }
+    ALPAKA_FN_ACC double& aux1(int32_t slot) const { return trackAux1[slot]; }
+    ALPAKA_FN_ACC double& aux2(int32_t slot) const { return trackAux2[slot]; }
   };
 
   class ClusterizerAlgo {
   public:
-    ClusterizerAlgo(Queue& queue);
-    void clusterize(Queue& queue, portablevertex::TrackDeviceCollection& inputTracks, portablevertex::VertexDeviceCollection& deviceVertex, const std::shared_ptr<portablevertex::ClusterParamsHostCollection> cParams, int32_t nBlocks, int32_t blockSize); // Clusterization
-    void arbitrate(Queue& queue, portablevertex::TrackDeviceCollection& inputTracks, portablevertex::VertexDeviceCollection& deviceVertex, const std::shared_ptr<portablevertex::ClusterParamsHostCollection> cParams, int32_t nBlocks, int32_t blockSize); // Arbitration
+    ClusterizerAlgo(int32_t convergenceMode); // Picks the kernel variant compiled for this clusterConvergenceModes value
+    void clusterize(Queue& queue, const portablevertex::TrackDeviceCollection& inputTracks, portablevertex::VertexDeviceCollection& deviceVertex, const ClusterParamsCollection& cParams, int32_t nBlocks, const clusterizerWorkspace& ws); // Clusterization
+    void arbitrate(Queue& queue, const portablevertex::TrackDeviceCollection& inputTracks, portablevertex::VertexDeviceCollection& deviceVertex, const ClusterParamsCollection& cParams, int32_t nBlocks, const clusterizerWorkspace& ws); // Arbitration
   private:
+    int32_t convergenceMode_;
   };
 
 }  // namespace ALPAKA_ACCELERATOR_NAMESPACE
@@ -3,17 +3,66 @@
 #include "HeterogeneousCore/AlpakaInterface/interface/config.h"
 #include "HeterogeneousCore/AlpakaInterface/interface/workdivision.h"
 
+#include "RecoVertex/PrimaryVertexProducer_Alpaka/plugins/alpaka/BlockPrimitives.h"
 #include "RecoVertex/PrimaryVertexProducer_Alpaka/plugins/alpaka/FitterAlgo.h"
 
 #define DEBUG_RECOVERTEX_PRIMARYVERTEXPRODUCER_ALPAKA_FITTERALGO 1
 
 namespace ALPAKA_ACCELERATOR_NAMESPACE {
   using namespace cms::alpakatools; 
+  constexpr int cooperativeFitThreads = 32; // Threads per block of fitVerticesCooperative, a warp, which also sizes its shared scratch
 
+  class fitTrackOffsetsKernel {
+  public:
+    template <typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>>
+    ALPAKA_FN_ACC void operator()(const TAcc& acc, portablevertex::VertexDeviceCollection::View vertices, const fitterWorkspace ws, int32_t maxVertices) const{
+      // Start of the tracks of each vertex row in the vertex-ordered copy, by a scan of the track counts of the good vertices. Single block
+      int nThreads  = alpaka::getWorkDiv<alpaka::Block, alpaka::Threads>(acc)[0u]; // Threads per block, 1 on the CPU backends
+      int threadIdx = alpaka::getIdx<alpaka::Block, alpaka::Threads>(acc)[0u]; // Thread number inside block
+      const int nTrueVertex = std::min(vertices[0].nV(), maxVertices);
+      for (int i = threadIdx; i <= nTrueVertex; i += nThreads){
+        ws.vertexTrackOffset[i] = ((i < nTrueVertex) && vertices[i].isGood()) ? vertices[i].ntracks() : 0;
+      }
+      alpaka::syncBlockThreads(acc);
+      auto& scratch = alpaka::declareSharedVar<blockScratch, __COUNTER__>(acc);
+      blockExclusiveScan(acc, scratch, ws.vertexTrackOffset, nTrueVertex + 1);
+    } // operator()
+  }; // class fitTrackOffsetsKernel
+
+  class gatherFitTracks {
+  public:
+    template <typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>>
+    ALPAKA_FN_ACC void operator()(const TAcc& acc,  const portablevertex::TrackDeviceCollection::ConstView tracks, portablevertex::VertexDeviceCollection::View vertices, const fitterWorkspace ws, int32_t maxVertices) const{
+      // Copy the fit inputs of the tracks of each vertex next to each other, one block per vertex row. This is the only place where they are gathered through track_id
+      int nThreads  = alpaka::getWorkDiv<alpaka::Block, alpaka::Threads>(acc)[0u]; // Threads per block, 1 on the CPU backends
+      int threadIdx = alpaka::getIdx<alpaka::Block, alpaka::Threads>(acc)[0u]; // Thread number inside block
+      int blockIdx  = alpaka::getIdx<alpaka::Grid, alpaka::Blocks>(acc)[0u]; // Block number inside grid
+      int nGridBlocks = alpaka::getWorkDiv<alpaka::Grid, alpaka::Blocks>(acc)[0u];
+      const int nTrueVertex = std::min(vertices[0].nV(), maxVertices);
+      for (int i = blockIdx; i < nTrueVertex; i += nGridBlocks){
+        if (not(vertices[i].isGood())) continue;
+        int offset = ws.vertexTrackOffset[i];
+        for (int itrackInVertex = threadIdx; itrackInVertex < vertices[i].ntracks(); itrackInVertex += nThreads){
+          int itrack = vertices[i].track_id()[itrackInVertex];
+          int ifit = offset + itrackInVertex;
+          ws.trackX[ifit]    = tracks[itrack].x();
+          ws.trackY[ifit]    = tracks[itrack].y();
+          ws.trackZ[ifit]    = tracks[itrack].z();
+          ws.trackPx[ifit]   = tracks[itrack].px();
+          ws.trackPy[ifit]   = tracks[itrack].py();
+          ws.trackPz[ifit]   = tracks[itrack].pz();
+          ws.trackDxy2[ifit] = tracks[itrack].dxy2();
+          ws.trackDz2[ifit]  = tracks[itrack].dz2();
+        }
+      }
+    } // operator()
+  }; // class gatherFitTracks
+
+  template <bool useBeamSpotConstraint> // Compiled for both settings, the host picks the one configured
   class fitVertices {
   public:
     template <typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>>
-    ALPAKA_FN_ACC void operator()(const TAcc& acc,  const portablevertex::TrackDeviceCollection::ConstView tracks, portablevertex::VertexDeviceCollection::View vertices, const portablevertex::BeamSpotDeviceCollection::ConstView beamSpot, bool* useBeamSpotConstraint) const{
+    ALPAKA_FN_ACC void operator()(const TAcc& acc,  const portablevertex::TrackDeviceCollection::ConstView tracks, portablevertex::VertexDeviceCollection::View vertices, const portablevertex::BeamSpotDeviceCollection::ConstView beamSpot, const fitterWorkspace ws, int32_t maxVertices) const{
       if (once_per_block(acc)){
         #ifdef DEBUG_RECOVERTEX_PRIMARYVERTEXPRODUCER_ALPAKA_FITTERALGO
 	  printf("[FitterAlgo::fitVertices()] In Vertex 0, %i tracks\n", vertices[0].ntracks());
@@ -26,7 +75,7 @@ namespace ALPAKA_ACCELERATOR_NAMESPACE {
         }
       }
       // These are the kernel operations themselves
-      const int nTrueVertex = vertices[0].nV(); // Set max true vertex
+      const int nTrueVertex = std::min(vertices[0].nV(), maxVertices); // Set max true vertex, never above the size of the collection
       // Magic numbers from https://github.com/cms-sw/cmssw/blob/master/RecoVertex/PrimaryVertexProducer/interface/WeightedMeanFitter.h#L12
       const float precision = 1e-24;
       const float precisionsq = precision*precision;
@@ -39,7 +88,7 @@ namespace ALPAKA_ACCELERATOR_NAMESPACE {
       float bserry = 0.;
       float bsx = 0.;
       float bsy = 0.;
-      if (*useBeamSpotConstraint){
+      if constexpr (useBeamSpotConstraint){
         bserrx = beamSpot.sx() < precisionsq ? 1./(precisionsq) : 1./(beamSpot.sx());
         bserry = beamSpot.sy() < precisionsq ? 1./(precisionsq) : 1./(beamSpot.sy());
         bsx    = beamSpot.x();
@@ -49,7 +98,7 @@ namespace ALPAKA_ACCELERATOR_NAMESPACE {
       #ifdef DEBUG_RECOVERTEX_PRIMARYVERTEXPRODUCER_ALPAKA_FITTERALGO
         printf("[FitterAlgo::fitVertices()] Set-up, beamspot constrains: %1.9f, %1.9f, %1.9f, %1.9f\n", bserrx, bserry, bsx, bsy);
       #endif
-      for (auto i : elements_with_stride(acc, nTrueVertex) ) { // By construction nTrueVertex <= 512, so this will always be a 1 thread to 1 vertex assignment
+      for (auto i : elements_with_stride(acc, nTrueVertex) ) { // The grid is sized to the collection, so this will always be a 1 thread to 1 vertex assignment
         if (not(vertices[i].isGood())) continue; // If vertex was killed before, just skip
         // Initialize positions and errors to 0
 	#ifdef DEBUG_RECOVERTEX_PRIMARYVERTEXPRODUCER_ALPAKA_FITTERALGO
@@ -62,12 +111,12 @@ namespace ALPAKA_ACCELERATOR_NAMESPACE {
         float errz = 0.;
 
 	for (int itrackInVertex = 0; itrackInVertex < vertices[i].ntracks(); itrackInVertex++){
-	  int itrack = vertices[i].track_id()[itrackInVertex];
-	  float wxy = tracks[itrack].dxy2() <= precisionsq ? 1./precisionsq : 1./tracks[itrack].dxy2();
-	  float wz  = tracks[itrack].dz2() <= precisionsq ? 1./precisionsq : 1./tracks[itrack].dz2();
-	  x += tracks[itrack].x()*wxy;
-	  y += tracks[itrack].y()*wxy;
-	  z += tracks[itrack].z()*wz;
+	  int itrack = ws.vertexTrackOffset[i] + itrackInVertex; // Vertex-ordered copy, see gatherFitTracks
+	  float wxy = ws.trackDxy2[itrack] <= precisionsq ? 1./precisionsq : 1./ws.trackDxy2[itrack];
+	  float wz  = ws.trackDz2[itrack] <= precisionsq ? 1./precisionsq : 1./ws.trackDz2[itrack];
+	  x += ws.trackX[itrack]*wxy;
+	  y += ws.trackY[itrack]*wxy;
+	  z += ws.trackZ[itrack]*wz;
 	  errx += wxy; // x and y have the same error due to symmetry
 	  errz += wz;
 	}
@@ -107,15 +156,15 @@ namespace ALPAKA_ACCELERATOR_NAMESPACE {
 	  z = 0.;
 	  ndof = 0;
 	  for (int itrackInVertex = 0; itrackInVertex < vertices[i].ntracks(); itrackInVertex++){
-            int itrack = vertices[i].track_id()[itrackInVertex];
+            int itrack = ws.vertexTrackOffset[i] + itrackInVertex;
             // Position (ref point) of the track
-	    double tx = tracks[itrack].x();
-	    double ty = tracks[itrack].y();
-	    double tz = tracks[itrack].z();
+	    double tx = ws.trackX[itrack];
+	    double ty = ws.trackY[itrack];
+	    double tz = ws.trackZ[itrack];
 	    // Momentum of the track
-            double px = tracks[itrack].px();
-            double py = tracks[itrack].py();
-            double pz = tracks[itrack].pz();
+            double px = ws.trackPx[itrack];
+            double py = ws.trackPy[itrack];
+            double pz = ws.trackPz[itrack];
 	    // To compute the PCA of the track to the current vertex
 	    double pnorm2 = px*px+py*py+pz*pz;
 	    // This is the 'time' needed to move from the ref point to the PCA scalar product of (x_v-x_t)*p_t over magnitude squared of p_t
@@ -127,8 +176,8 @@ namespace ALPAKA_ACCELERATOR_NAMESPACE {
 	    tx += px*t;
 	    ty += py*t;
 	    tz += pz*t;
-	    float wx = tracks[itrack].dxy2() <= precisionsq ? 1./precisionsq : 1./tracks[itrack].dxy2();
-            float wz = tracks[itrack].dz2() <= precisionsq ? 1./precisionsq : 1./tracks[itrack].dz2();
+	    float wx = ws.trackDxy2[itrack] <= precisionsq ? 1./precisionsq : 1./ws.trackDxy2[itrack];
+            float wz = ws.trackDz2[itrack] <= precisionsq ? 1./precisionsq : 1./ws.trackDz2[itrack];
 	    #ifdef DEBUG_RECOVERTEX_PRIMARYVERTEXPRODUCER_ALPAKA_FITTERALGO
 	      printf("[FitterAlgo::fitVertices()] Track wx: %1.9f, wz: %1.9f\n", wx, wz);
 	      printf("[FitterAlgo::fitVertices()] Track sigmas: %1.3f %1.3f %1.3f\n", (tx-old_x)*(tx-old_x)/(1/wx+errx), (ty-old_y)*(ty-old_y)/(1/wx+erry), (tz-old_z)*(tz-old_z)/(1/wz+errz));
@@ -197,13 +246,13 @@ namespace ALPAKA_ACCELERATOR_NAMESPACE {
         // Last get the chi square of the final vertex fit 
         float chi2 = 0.;
         for (int itrackInVertex = 0; itrackInVertex < vertices[i].ntracks(); itrackInVertex++){
-          int itrack = vertices[i].track_id()[itrackInVertex];
+          int itrack = ws.vertexTrackOffset[i] + itrackInVertex;
           // Position (ref point) of the track
-          float tx = tracks[itrack].x();
-          float ty = tracks[itrack].y();
-          float tz = tracks[itrack].z();
-          float wx = tracks[itrack].dxy2();
-          float wz = tracks[itrack].dz2();
+          float tx = ws.trackX[itrack];
+          float ty = ws.trackY[itrack];
+          float tz = ws.trackZ[itrack];
+          float wx = ws.trackDxy2[itrack];
+          float wz = ws.trackDz2[itrack];
           chi2 += (tx-x)*(tx-x)/(errx+wx) + (ty-y)*(ty-y)/(erry+wx) + (tz-z)*(tz-z)/(errz+wz); // chi2 doesn't use the PCA distance, but the ref point coordinates as in https://github.com/cms-sw/cmssw/blob/master/RecoVertex/PrimaryVertexProducer/interface/WeightedMeanFitter.h#L316
         } // end for
         vertices[i].chi2() = chi2;
@@ -214,21 +263,212 @@ namespace ALPAKA_ACCELERATOR_NAMESPACE {
     } // operator()
   }; // class fitVertices
 
-  FitterAlgo::FitterAlgo(Queue& queue, const int32_t nV, fitterParameters fPar) : useBeamSpotConstraint(cms::alpakatools::make_device_buffer<bool>(queue)) {
-    // Set fitter parameters
-    alpaka::memset(queue,  useBeamSpotConstraint, fPar.useBeamSpotConstraint);
+  template <bool useBeamSpotConstraint>
+  class fitVerticesCooperative {
+  public:
+    template <typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>>
+    ALPAKA_FN_ACC void operator()(const TAcc& acc,  const portablevertex::TrackDeviceCollection::ConstView tracks, portablevertex::VertexDeviceCollection::View vertices, const portablevertex::BeamSpotDeviceCollection::ConstView beamSpot, const fitterWorkspace ws, int32_t maxVertices) const{
+      // Same fit as fitVertices, but each vertex is fitted by a whole block: the threads share its tracks and the weighted sums are block reductions
+      // A vertex with many tracks no longer keeps a single thread busy while the others are done, and blocks past the vertices that survived the clusterizer return right away
+      int nThreads  = alpaka::getWorkDiv<alpaka::Block, alpaka::Threads>(acc)[0u]; // Threads per block, 1 on the CPU backends
+      int threadIdx = alpaka::getIdx<alpaka::Block, alpaka::Threads>(acc)[0u]; // Thread number inside block
+      int blockIdx  = alpaka::getIdx<alpaka::Grid, alpaka::Blocks>(acc)[0u]; // Block number inside grid
+      int nGridBlocks = alpaka::getWorkDiv<alpaka::Grid, alpaka::Blocks>(acc)[0u];
+      auto& scratch = alpaka::declareSharedVar<blockScratchOf<cooperativeFitThreads>, __COUNTER__>(acc); // Sized to the launch, a full blockScratch would limit the number of these small blocks per multiprocessor
+      const int nTrueVertex = std::min(vertices[0].nV(), maxVertices); // Set max true vertex, never above the size of the collection
+      // Magic numbers from https://github.com/cms-sw/cmssw/blob/master/RecoVertex/PrimaryVertexProducer/interface/WeightedMeanFitter.h#L12
+      const float precision = 1e-24;
+      const float precisionsq = precision*precision;
+      float corr_x = 1.2;
+      const float corr_z = 1.4;
+      const int maxIterations = 2;
+      const float muSquare = 9.;
+      // BeamSpot coordinates are initialized to 0, if we use beamSpot, we change them
+      float bserrx = 0.;
+      float bserry = 0.;
+      float bsx = 0.;
+      float bsy = 0.;
+      if constexpr (useBeamSpotConstraint){
+        bserrx = beamSpot.sx() < precisionsq ? 1./(precisionsq) : 1./(beamSpot.sx());
+        bserry = beamSpot.sy() < precisionsq ? 1./(precisionsq) : 1./(beamSpot.sy());
+        bsx    = beamSpot.x();
+        bsy    = beamSpot.y();
+        corr_x = 1.0;
+      }
+      for (int i = blockIdx; i < nTrueVertex; i += nGridBlocks){ // All threads of the block work on vertex i
+        if (not(vertices[i].isGood())) continue; // Same for all threads, so they all skip it
+        int ntracks = vertices[i].ntracks();
+        // First estimation from the track reference points
+        float x = 0.;
+        float y = 0.;
+        float z = 0.;
+        float errx = 0.;
+        float errz = 0.;
+        for (int itrackInVertex = threadIdx; itrackInVertex < ntracks; itrackInVertex += nThreads){
+          int itrack = ws.vertexTrackOffset[i] + itrackInVertex; // Vertex-ordered copy, see gatherFitTracks
+          float wxy = ws.trackDxy2[itrack] <= precisionsq ? 1./precisionsq : 1./ws.trackDxy2[itrack];
+          float wz  = ws.trackDz2[itrack] <= precisionsq ? 1./precisionsq : 1./ws.trackDz2[itrack];
+          x += ws.trackX[itrack]*wxy;
+          y += ws.trackY[itrack]*wxy;
+          z += ws.trackZ[itrack]*wz;
+          errx += wxy; // x and y have the same error due to symmetry
+          errz += wz;
+        }
+        x = blockSum(acc, scratch, x);
+        y = blockSum(acc, scratch, y);
+        z = blockSum(acc, scratch, z);
+        errx = blockSum(acc, scratch, errx);
+        errz = blockSum(acc, scratch, errz);
+        float erry = errx;
+        // Now add the BeamSpot and get first estimation, if no beamspot, this changes nothing
+        x = (x + bsx*bserrx*bserrx)/(bserrx*bserrx + errx);
+        y = (y + bsy*bserry*bserry)/(bserry*bserry + erry);
+        z /= errz;
+        errx = 1/errx;
+        erry = 1/erry;
+        errz = 1/errz;
+        int ndof = 0;
+        // Run iterative weighted mean fitter, every thread gets the same sums so they all take the same decisions
+        int niter = 0;
+        while ((niter++) < maxIterations){
+          float old_x = x;
+          float old_y = y;
+          float old_z = z;
+          float s_wx = 0.;
+          float s_wz = 0.;
+          double nkept = 0.;
+          x = 0.;
+          y = 0.;
+          z = 0.;
+          for (int itrackInVertex = threadIdx; itrackInVertex < ntracks; itrackInVertex += nThreads){
+            int itrack = ws.vertexTrackOffset[i] + itrackInVertex;
+            // Position (ref point) and momentum of the track
+            double tx = ws.trackX[itrack];
+            double ty = ws.trackY[itrack];
+            double tz = ws.trackZ[itrack];
+            double px = ws.trackPx[itrack];
+            double py = ws.trackPy[itrack];
+            double pz = ws.trackPz[itrack];
+            // Advance the track to its PCA to the current vertex
+            double pnorm2 = px*px+py*py+pz*pz;
+            double t = (px*(old_x-tx)+py*(old_y-ty)+pz*(old_z-tz))/pnorm2;
+            tx += px*t;
+            ty += py*t;
+            tz += pz*t;
+            float wx = ws.trackDxy2[itrack] <= precisionsq ? 1./precisionsq : 1./ws.trackDxy2[itrack];
+            float wz = ws.trackDz2[itrack] <= precisionsq ? 1./precisionsq : 1./ws.trackDz2[itrack];
+            if (((tx-old_x)*(tx-old_x)/(1/wx+errx) < muSquare) && ((ty-old_y)*(ty-old_y)/(1/wx+erry) < muSquare) && ((tz-old_z)*(tz-old_z)/(1/wz+errz) < muSquare)){ // I.e., old coordinates of PCA are within 3 sigma of current vertex position, keep the track
+              nkept += 1.;
+              vertices[i].track_weight()[itrackInVertex] = 1;
+              s_wx += wx;
+              s_wz += wz;
+            }
+            else{ // Otherwise, discard track
+              vertices[i].track_weight()[itrackInVertex] = 0;
+              wx = 0.;
+              wz = 0.;
+            }
+            x += tx*wx;
+            y += ty*wx;
+            z += tz*wz;
+          } // end for
+          x = blockSum(acc, scratch, x);
+          y = blockSum(acc, scratch, y);
+          z = blockSum(acc, scratch, z);
+          s_wx = blockSum(acc, scratch, s_wx);
+          s_wz = blockSum(acc, scratch, s_wz);
+          ndof = static_cast<int>(blockSum(acc, scratch, nkept));
+          // After all tracks, add BS uncertainties, will do nothing if not used
+          x += bsx*bserrx;
+          y += bsy*bserry;
+          float s_wy = s_wx;
+          s_wx += bserrx;
+          s_wy += bserry;
+          x /= s_wx;
+          y /= s_wy;
+          z /= s_wz;
+          errx = 1/s_wx;
+          errz = 1/s_wz;
+          erry = 1/s_wy;
+          if ((abs(old_x-x) < precision) && (abs(old_y-y) < precision) && (abs(old_z-z) < precision)) break; // If good enough, stop the iterations
+        } // end while
+        errx *= corr_x*corr_x;
+        erry *= corr_x*corr_x;
+        errz *= corr_z*corr_z;
+        // Last get the chi square of the final vertex fit, with the ref point coordinates as fitVertices
+        float chi2 = 0.;
+        for (int itrackInVertex = threadIdx; itrackInVertex < ntracks; itrackInVertex += nThreads){
+          int itrack = ws.vertexTrackOffset[i] + itrackInVertex;
+          float tx = ws.trackX[itrack];
+          float ty = ws.trackY[itrack];
+          float tz = ws.trackZ[itrack];
+          float wx = ws.trackDxy2[itrack];
+          float wz = ws.trackDz2[itrack];
+          chi2 += (tx-x)*(tx-x)/(errx+wx) + (ty-y)*(ty-y)/(erry+wx) + (tz-z)*(tz-z)/(errz+wz);
+        }
+        chi2 = blockSum(acc, scratch, chi2);
+        if (once_per_block(acc)){
+          vertices[i].x() = x;
+          vertices[i].y() = y;
+          vertices[i].z() = z;
+          vertices[i].errx() = errx;
+          vertices[i].erry() = erry;
+          vertices[i].errz() = errz;
+          vertices[i].ndof() = ndof;
+          vertices[i].chi2() = chi2;
+        }
+      } // end vertex for
+    } // operator()
+  }; // class fitVerticesCooperative
+
+  FitterAlgo::FitterAlgo(fitterParameters fPar) : useBeamSpotConstraint_(fPar.useBeamSpotConstraint), mode_(fPar.mode) {
   } // FitterAlgo::FitterAlgo
   
-  void FitterAlgo::fit(Queue& queue, const portablevertex::TrackDeviceCollection& deviceTrack, portablevertex::VertexDeviceCollection& deviceVertex, const portablevertex::BeamSpotDeviceCollection& deviceBeamSpot){
-    const int nVertexToFit = 512; // TODO:: Right now it executes for all 512 vertex, even if vertex collection is empty (in which case the kernel passes). Can we make this dynamic to vertex size?
+  void FitterAlgo::fit(Queue& queue, const portablevertex::TrackDeviceCollection& deviceTrack, portablevertex::VertexDeviceCollection& deviceVertex, const portablevertex::BeamSpotDeviceCollection& deviceBeamSpot, const fitterWorkspace& ws){
+    const int nVertexToFit = deviceVertex.view().metadata().size(); // The collection is sized per event to the expected multiplicity
     const int threadsPerBlock = 32;
-    const int blocks = divide_up_by(nVertexToFit, threadsPerBlock);
+    // First lay the tracks out in vertex order, both fit kernels then read each vertex's tracks contiguously
+    alpaka::exec<Acc1D>(queue,
+                        make_workdiv<Acc1D>(1, 256), // Single block, a scan over the vertex rows
+                        fitTrackOffsetsKernel{},
+                        deviceVertex.view(),
+                        ws,
+                        nVertexToFit);
     alpaka::exec<Acc1D>(queue,
-		        make_workdiv<Acc1D>(blocks, threadsPerBlock),
-			fitVertices{},
-			deviceTrack.view(), // TODO:: Maybe we can optimize the compiler by not making this const? Tracks would not be modified
-			deviceVertex.view(),
-			deviceBeamSpot.view(), // TODO:: Same as for tracks
-			useBeamSpotConstraint.data()); 
+                        make_workdiv<Acc1D>(nVertexToFit, threadsPerBlock), // One block per vertex row
+                        gatherFitTracks{},
+                        deviceTrack.view(),
+                        deviceVertex.view(),
+                        ws,
+                        nVertexToFit);
+    if (mode_ == fitterBlockPerVertex){
+      // One block of a warp per vertex slot. Only the first nV slots hold vertices after the arbitration, the blocks of the other ones leave at once
+      auto launch = [&](auto kernel){
+        alpaka::exec<Acc1D>(queue,
+                            make_workdiv<Acc1D>(nVertexToFit, cooperativeFitThreads),
+                            kernel,
+                            deviceTrack.view(),
+                            deviceVertex.view(),
+                            deviceBeamSpot.view(),
+                            ws,
+                            nVertexToFit);
+      };
+      if (useBeamSpotConstraint_) launch(fitVerticesCooperative<true>{});
+      else launch(fitVerticesCooperative<false>{});
+      return;
+    }
+    const int blocks = divide_up_by(nVertexToFit, threadsPerBlock);
+    auto launch = [&](auto kernel){
+      alpaka::exec<Acc1D>(queue,
+		          make_workdiv<Acc1D>(blocks, threadsPerBlock),
+			  kernel,
+			  deviceTrack.view(), // TODO:: Maybe we can optimize the compiler by not making this const? Tracks would not be modified
+			  deviceVertex.view(),
+			  deviceBeamSpot.view(), // TODO:: Same as for tracks
+			  ws,
+			  nVertexToFit);
+    };
+    if (useBeamSpotConstraint_) launch(fitVertices<true>{});
+    else launch(fitVertices<false>{});
   } // FitterAlgo::fit
 } // namespace ALPAKA_ACCELERATOR_NAMESPACE
@@ -11,14 +11,37 @@ namespace ALPAKA_ACCELERATOR_NAMESPACE {
     double minNdof;  // Unused?
     bool useBeamSpotConstraint;
     double maxDistanceToBeam; // Unused?
+    int32_t mode; // fitterModes value
+  };
+
+  // How the vertices are spread over the device threads
+  enum fitterModes : int32_t {
+    fitterThreadPerVertex = 0, // Each thread fits one vertex, going through its tracks alone
+    fitterBlockPerVertex = 1   // Each vertex is fitted by a block of a warp, which shares its tracks and reduces the weighted sums together
+  };
+
+  // Fit inputs of the tracks of all vertices, copied in vertex order after the arbitration so that each vertex reads its tracks contiguously instead of gathering them through track_id
+  // Entry vertexTrackOffset[i] + k holds track k of vertex row i
+  struct fitterWorkspace {
+    int32_t* vertexTrackOffset; // Per vertex row, first entry of its tracks, maxVertices+1 entries
+    double* trackX;
+    double* trackY;
+    double* trackZ;
+    double* trackPx;
+    double* trackPy;
+    double* trackPz;
+    double* trackDxy2;
+    double* trackDz2;
+    static int32_t doubleScratchSize(int32_t maxTracks) { return 8*maxTracks; } // double needed by the arrays above, a track is in at most one vertex
   };
 
   class FitterAlgo {
   public:
-    FitterAlgo(Queue& queue, const int32_t nV, fitterParameters fPar); // Just configuration and making job divisions
-    void fit(Queue& queue, const portablevertex::TrackDeviceCollection& deviceTrack, portablevertex::VertexDeviceCollection& deviceVertex, const portablevertex::BeamSpotDeviceCollection& deviceBeamSpot); // The actual fitting
+    FitterAlgo(fitterParameters fPar); // Just configuration, which picks the kernel variant
+    void fit(Queue& queue, const portablevertex::TrackDeviceCollection& deviceTrack, portablevertex::VertexDeviceCollection& deviceVertex, const portablevertex::BeamSpotDeviceCollection& deviceBeamSpot, const fitterWorkspace& ws); // The actual fitting
   private:
-    cms::alpakatools::device_buffer<Device, bool> useBeamSpotConstraint;
+    bool useBeamSpotConstraint_;
+    int32_t mode_;
   };
 
 }  // namespace ALPAKA_ACCELERATOR_NAMESPACE
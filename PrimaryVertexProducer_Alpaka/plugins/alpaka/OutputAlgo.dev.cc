@@ -0,0 +1,70 @@
+#include <alpaka/alpaka.hpp>
+
+#include "HeterogeneousCore/AlpakaInterface/interface/config.h"
+#include "HeterogeneousCore/AlpakaInterface/interface/workdivision.h"
+
+#include "RecoVertex/PrimaryVertexProducer_Alpaka/plugins/alpaka/OutputAlgo.h"
+
+namespace ALPAKA_ACCELERATOR_NAMESPACE {
+  using namespace cms::alpakatools;
+
+  class compactVerticesKernel {
+  public:
+    template <typename TAcc, typename = std::enable_if_t<alpaka::isAccelerator<TAcc>>>
+    ALPAKA_FN_ACC void operator()(const TAcc& acc,  const portablevertex::TrackDeviceCollection::ConstView tracks, const portablevertex::VertexDeviceCollection::ConstView vertices, portablevertex::VertexDeviceCollection::View output, int32_t nGood) const{
+      // The arbitration already put the good vertices in z order in the first nGood rows, so this is a copy of those rows, one block per row
+      // The track lists hold rows of the z-sorted track collection during the vertexing, here they are turned into the reco::Track indices the consumers expect
+      int nThreads  = alpaka::getWorkDiv<alpaka::Block, alpaka::Threads>(acc)[0u]; // Threads per block, 1 on the CPU backends
+      int threadIdx = alpaka::getIdx<alpaka::Block, alpaka::Threads>(acc)[0u]; // Thread number inside block
+      int blockIdx  = alpaka::getIdx<alpaka::Grid, alpaka::Blocks>(acc)[0u]; // Block number inside grid
+      int nGridBlocks = alpaka::getWorkDiv<alpaka::Grid, alpaka::Blocks>(acc)[0u];
+      if ((nGood == 0) && once_per_grid(acc)) output[0].isGood() = false; // The collection keeps one row to carry nV
+      for (int i = blockIdx; i < nGood; i += nGridBlocks){
+        int ntracks = vertices[i].ntracks();
+        for (int k = threadIdx; k < ntracks; k += nThreads){
+          output[i].track_id()[k]     = tracks[vertices[i].track_id()[k]].tt_index();
+          output[i].track_weight()[k] = vertices[i].track_weight()[k];
+        }
+        if (once_per_block(acc)){
+          output[i].x()       = vertices[i].x();
+          output[i].y()       = vertices[i].y();
+          output[i].z()       = vertices[i].z();
+          output[i].errx()    = vertices[i].errx();
+          output[i].erry()    = vertices[i].erry();
+          output[i].errz()    = vertices[i].errz();
+          output[i].chi2()    = vertices[i].chi2();
+          output[i].ndof()    = vertices[i].ndof();
+          output[i].ntracks() = ntracks;
+          output[i].rho()     = vertices[i].rho();
+          output[i].order()   = i;
+          output[i].isGood()  = vertices[i].isGood();
+          // The clusterizer bookkeeping has no meaning outside of it
+          output[i].sw()      = 0.;
+          output[i].se()      = 0.;
+          output[i].swz()     = 0.;
+          output[i].swE()     = 0.;
+          output[i].exp()     = 0.;
+          output[i].exparg()  = 0.;
+          output[i].aux1()    = 0.;
+          output[i].aux2()    = 0.;
+        }
+      }
+      if (once_per_grid(acc)) output[0].nV() = nGood;
+    } // compactVerticesKernel::operator()
+  }; // class compactVerticesKernel
+
+  OutputAlgo::OutputAlgo() {
+  } // OutputAlgo::OutputAlgo
+
+  void OutputAlgo::compact(Queue& queue, const portablevertex::TrackDeviceCollection& deviceTrack, const portablevertex::VertexDeviceCollection& deviceVertex, portablevertex::VertexDeviceCollection& outputVertex, int32_t nGood){
+    // outputVertex has max(nGood, 1) rows, nGood being the host copy of vertices[0].nV() after the fit
+    const int threadsPerBlock = 32;
+    alpaka::exec<Acc1D>(queue,
+                        make_workdiv<Acc1D>(outputVertex.view().metadata().size(), threadsPerBlock), // One block per output row
+                        compactVerticesKernel{},
+                        deviceTrack.view(),
+                        deviceVertex.view(),
+                        outputVertex.view(),
+                        nGood);
+  } // OutputAlgo::compact
+} // namespace ALPAKA_ACCELERATOR_NAMESPACE
@@ -0,0 +1,19 @@
+#ifndef RecoVertex_PrimaryVertexProducer_Alpaka_plugins_alpaka_OutputAlgo_h
+#define RecoVertex_PrimaryVertexProducer_Alpaka_plugins_alpaka_OutputAlgo_h
+
+#include "DataFormats/PortableVertex/interface/alpaka/VertexDeviceCollection.h"
+#include "HeterogeneousCore/AlpakaInterface/interface/config.h"
+
+namespace ALPAKA_ACCELERATOR_NAMESPACE {
+
+  class OutputAlgo {
+  public:
+    OutputAlgo();
+    void compact(Queue& queue, const portablevertex::TrackDeviceCollection& deviceTrack, const portablevertex::VertexDeviceCollection& deviceVertex, portablevertex::VertexDeviceCollection& outputVertex, int32_t nGood); // Copies the good vertices to a collection sized to them, with the track lists pointing to the reco::Track collection
+
+  private:
+  };
+
+}  // namespace ALPAKA_ACCELERATOR_NAMESPACE
+
+#endif  // RecoVertex_PrimaryVertexProducer_Alpaka_plugins_alpaka_OutputAlgo_h
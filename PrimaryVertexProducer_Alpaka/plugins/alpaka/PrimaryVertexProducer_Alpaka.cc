@@ -1,10 +1,15 @@
+#include <algorithm>
+#include <optional>
+#include <string>
+
 #include "DataFormats/PortableVertex/interface/alpaka/VertexDeviceCollection.h"
 #include "DataFormats/PortableVertex/interface/VertexHostCollection.h"
+#include "FWCore/MessageLogger/interface/MessageLogger.h"
 #include "FWCore/ParameterSet/interface/ConfigurationDescriptions.h"
 #include "FWCore/ParameterSet/interface/ParameterSet.h"
 #include "FWCore/ParameterSet/interface/ParameterSetDescription.h"
 #include "FWCore/Utilities/interface/InputTag.h"
-#include "HeterogeneousCore/AlpakaCore/interface/alpaka/stream/EDProducer.h"
+#include "HeterogeneousCore/AlpakaCore/interface/alpaka/stream/SynchronizingEDProducer.h"
 #include "HeterogeneousCore/AlpakaCore/interface/alpaka/EDPutToken.h"
 #include "HeterogeneousCore/AlpakaCore/interface/alpaka/ESGetToken.h"
 #include "HeterogeneousCore/AlpakaInterface/interface/config.h"
@@ -19,6 +24,8 @@
 #include "BlockAlgo.h"
 #include "ClusterizerAlgo.h"
 #include "FitterAlgo.h"
+#include "OutputAlgo.h"
+#include "VertexingWorkspace.h"
 
 
 
@@ -29,8 +36,11 @@ namespace ALPAKA_ACCELERATOR_NAMESPACE {
    * - clusterizing them into track clusters
    * - fitting cluster properties to vertex coordinates
    * - produces a device vertex product (portablevertex::Vertex)
+   * The vertex capacity is sized per event from the track multiplicity; the algorithm work is enqueued in acquire()
+   * and produce() checks whether the capacity was exceeded, then puts in the event a copy of only the good vertices,
+   * whose track lists point to the reco::Track collection
    */
-  class PrimaryVertexProducer_Alpaka : public stream::EDProducer<> {
+  class PrimaryVertexProducer_Alpaka : public stream::SynchronizingEDProducer<> {
   public:
     PrimaryVertexProducer_Alpaka(edm::ParameterSet const& config){
       trackToken_     = consumes(config.getParameter<edm::InputTag>("TrackLabel"));
@@ -38,11 +48,19 @@ namespace ALPAKA_ACCELERATOR_NAMESPACE {
       devicePutToken_ = produces();
       blockSize       = config.getParameter<int32_t>("blockSize"); 
       blockOverlap    = config.getParameter<double>("blockOverlap");
+      blockPartitioning = config.getParameter<int32_t>("blockPartitioning");
+      blockHalo       = config.getParameter<int32_t>("blockHalo");
+      tracksPerVertexSlot = config.getParameter<int32_t>("tracksPerVertexSlot");
+      minVerticesPerBlock = config.getParameter<int32_t>("minVerticesPerBlock");
+      vertexListHeadroom  = config.getParameter<double>("vertexListHeadroom");
+      trackVertexWindow   = config.getParameter<int32_t>("trackVertexWindow");
+      expCacheTolerance   = config.getParameter<double>("expCacheTolerance");
       fitterParams = {
         .chi2cutoff            = config.getParameter<edm::ParameterSet>("TkFitterParameters").getParameter<double>("chi2cutoff"), // not used?
         .minNdof               = config.getParameter<edm::ParameterSet>("TkFitterParameters").getParameter<double>("minNdof"),  // not used?
         .useBeamSpotConstraint  = config.getParameter<edm::ParameterSet>("TkFitterParameters").getParameter<bool>("useBeamSpotConstraint"),
-        .maxDistanceToBeam     = config.getParameter<edm::ParameterSet>("TkFitterParameters").getParameter<double>("maxDistanceToBeam") //not used?
+        .maxDistanceToBeam     = config.getParameter<edm::ParameterSet>("TkFitterParameters").getParameter<double>("maxDistanceToBeam"), //not used?
+        .mode                  = config.getParameter<edm::ParameterSet>("TkFitterParameters").getParameter<int32_t>("mode")
       };
       clusterParams = {
         .Tmin   = config.getParameter<edm::ParameterSet>("TkClusParameters").getParameter<double>("Tmin"),
@@ -58,7 +76,13 @@ namespace ALPAKA_ACCELERATOR_NAMESPACE {
         .sel_zrange = config.getParameter<edm::ParameterSet>("TkClusParameters").getParameter<double>("zrange"),
         .convergence_mode = config.getParameter<edm::ParameterSet>("TkClusParameters").getParameter<int>("convergence_mode"),
         .delta_lowT = config.getParameter<edm::ParameterSet>("TkClusParameters").getParameter<double>("delta_lowT"),
-        .delta_highT = config.getParameter<edm::ParameterSet>("TkClusParameters").getParameter<double>("delta_highT")
+        .delta_highT = config.getParameter<edm::ParameterSet>("TkClusParameters").getParameter<double>("delta_highT"),
+        .seeding_mode = config.getParameter<edm::ParameterSet>("TkClusParameters").getParameter<int>("seeding_mode"),
+        .seed_binSize = config.getParameter<edm::ParameterSet>("TkClusParameters").getParameter<double>("seed_binSize"),
+        .seed_minWeight = config.getParameter<edm::ParameterSet>("TkClusParameters").getParameter<double>("seed_minWeight"),
+        .cooling_mode = config.getParameter<edm::ParameterSet>("TkClusParameters").getParameter<int>("cooling_mode"),
+        .cooling_minFactor = config.getParameter<edm::ParameterSet>("TkClusParameters").getParameter<double>("cooling_minFactor"),
+        .cooling_quietIterations = config.getParameter<edm::ParameterSet>("TkClusParameters").getParameter<int>("cooling_quietIterations")
       };
       cParams = std::make_shared<portablevertex::ClusterParamsHostCollection>(1, cms::alpakatools::host());
       auto cpview = cParams->view();
@@ -76,37 +100,77 @@ namespace ALPAKA_ACCELERATOR_NAMESPACE {
       cpview.convergence_mode() = clusterParams.convergence_mode;
       cpview.delta_lowT() = clusterParams.delta_lowT;
       cpview.delta_highT() = clusterParams.delta_highT;
+      // Both algorithms pick their compile-time kernel variants from the configuration here, once
+      clusterizerKernel_.emplace(clusterParams.convergence_mode);
+      fitterKernel_.emplace(fitterParams);
     }
 
-    void produce(device::Event& iEvent, device::EventSetup const& iSetup) {
+    void acquire(device::Event const& iEvent, device::EventSetup const& iSetup) override {
       const portablevertex::TrackDeviceCollection& inputtracks   = iEvent.get(trackToken_);
       const portablevertex::BeamSpotDeviceCollection& beamSpot     = iEvent.get(beamSpotToken_);
       int32_t nT = inputtracks.view().metadata().size();
-      int32_t nBlocks = nT > blockSize ? int32_t ((nT-1)/(blockOverlap*blockSize)) : 1; // If the block size is big enough we process everything at once
-      // Now the device collections we still need
-      portablevertex::TrackDeviceCollection tracksInBlocks{nBlocks*blockSize, iEvent.queue()}; // As high as needed
-      portablevertex::VertexDeviceCollection deviceVertex{512, iEvent.queue()}; // Hard capped to 512, though we might want to restrict it for low PU cases
+      int32_t nBlocks = BlockAlgo::nBlocks(nT, blockSize, blockOverlap, blockPartitioning, blockHalo);
+      // Scratch buffers come from the per-stream workspace and are reused across events
+      workspace_.acquire(iEvent.queue());
+      // The kernels read the cluster parameters from device memory, they are copied there with the first event of the stream and never change after
+      if (not cParamsDevice_){
+        cParamsDevice_.emplace(1, iEvent.queue());
+        alpaka::memcpy(iEvent.queue(), cParamsDevice_->buffer(), cParams->const_buffer());
+      }
+      // Vertex capacity follows the track multiplicity: one slot every tracksPerVertexSlot tracks in a block, with a floor for sparse blocks
+      // The slots are pooled, so a dense block can use the slots a sparse one does not need, up to vertexListHeadroom times its share. A block whose ordered list is full stops splitting and raises the overflow flag
+      int32_t tracksPerBlock = std::min(nT, blockSize);
+      int32_t verticesPerBlock = std::max(minVerticesPerBlock, (tracksPerBlock + tracksPerVertexSlot - 1)/tracksPerVertexSlot);
+      int32_t listCapacity = std::max(verticesPerBlock, std::min(std::max(tracksPerBlock, 1), static_cast<int32_t>(vertexListHeadroom*verticesPerBlock))); // Never more than a vertex per track
+      // Track-vertex terms are only kept for the vertices close enough to each track, budgeted at trackVertexWindow of them per track on average
+      clusterizerWorkspace ws = workspace_.clusterizer(iEvent.queue(), nBlocks, blockSize, listCapacity, nBlocks*verticesPerBlock, nT, blockSize*trackVertexWindow, expCacheTolerance); // tt_index is a row of the full reco::Track collection, whose size is nT
+      ws.seedingMode   = clusterParams.seeding_mode;
+      ws.seedBinSize   = clusterParams.seed_binSize;
+      ws.seedMinWeight = clusterParams.seed_minWeight;
+      ws.coolingMode   = clusterParams.cooling_mode;
+      ws.coolingMinFactor = clusterParams.cooling_minFactor;
+      ws.coolingQuietIterations = clusterParams.cooling_quietIterations;
+      // The vertex collection goes into the event, so it is the only one allocated per event
+      deviceVertex_.emplace(ws.maxVertices, iEvent.queue());
+      portablevertex::VertexDeviceCollection& deviceVertex = *deviceVertex_;
 
       // run the algorithm
+      // All steps are enqueued back-to-back in the event queue, which already serializes them on the device, with no host wait in between
+      // The only synchronization point is between acquire() and produce(): the overflow flag, the vertex count and, when enabled, the cooling steps copied at the end of acquire() are read on the host in produce(), which then enqueues the output compaction
       //// First create the individual blocks
-      BlockAlgo blockKernel_{}; 
-      blockKernel_.createBlocks(iEvent.queue(), inputtracks, tracksInBlocks, blockSize, blockOverlap);
-      // Need to have the blocks created before launching the next step
-      alpaka::wait(iEvent.queue());
+      blockKernel_.createBlocks(iEvent.queue(), inputtracks, blockSize, blockOverlap, blockPartitioning, blockHalo, nBlocks, ws);
 
-      //// Then run the clusterizer per blocks
-      ClusterizerAlgo clusterizerKernel_{iEvent.queue()}; 
-      clusterizerKernel_.clusterize(iEvent.queue(), tracksInBlocks, deviceVertex, cParams, nBlocks, blockSize);
-      // Need to have all vertex before arbitrating and deciding what we keep
-      alpaka::wait(iEvent.queue());
-      clusterizerKernel_.arbitrate(iEvent.queue(), tracksInBlocks, deviceVertex, cParams, nBlocks, blockSize);
-      alpaka::wait(iEvent.queue());
+      //// Then run the clusterizer per blocks, blocks are guaranteed to be created by queue ordering
+      clusterizerKernel_->clusterize(iEvent.queue(), inputtracks, deviceVertex, *cParamsDevice_, nBlocks, ws);
+      // Arbitration runs after all blocks have been clusterized, again guaranteed by queue ordering
+      clusterizerKernel_->arbitrate(iEvent.queue(), inputtracks, deviceVertex, *cParamsDevice_, nBlocks, ws);
       //// And then fit
-      FitterAlgo fitterKernel_{iEvent.queue(), deviceVertex.view().metadata().size(), fitterParams};
-      fitterKernel_.fit(iEvent.queue(), tracksInBlocks, deviceVertex, beamSpot);
+      fitterKernel_->fit(iEvent.queue(), inputtracks, deviceVertex, beamSpot, workspace_.fitter(iEvent.queue(), ws.maxVertices, nT)); // Vertex track lists hold rows of the input collection
+      // The overflow flag and the number of vertices are the only things the host needs back, they are read in produce() once the queue has completed
+      workspace_.copyOverflowToHost(iEvent.queue());
+      workspace_.copyVertexCountToHost(iEvent.queue(), deviceVertex);
+      // The temperature steps per block are only brought back when someone is going to read them
+      reportCoolingSteps_ = edm::isDebugEnabled();
+      if (reportCoolingSteps_) workspace_.copyCoolingStepsToHost(iEvent.queue());
+      // Nothing else in this event uses the scratch buffers
+      workspace_.release(iEvent.queue());
+    }
 
-      // Put the vertices in the event as a portable collection
-      iEvent.emplace(devicePutToken_, std::move(deviceVertex));
+    void produce(device::Event& iEvent, device::EventSetup const& iSetup) override {
+      int32_t overflow = workspace_.overflowFlags();
+      if (overflow & overflowClusterizer)
+        edm::LogWarning("PrimaryVertexProducer_Alpaka") << "Vertex capacity of " << deviceVertex_->view().metadata().size() << " exhausted during clustering, some vertex splits were not performed. Consider lowering tracksPerVertexSlot or raising minVerticesPerBlock or vertexListHeadroom";
+      if (reportCoolingSteps_){
+        std::string steps;
+        for (int32_t iblock = 0; iblock < workspace_.nBlocks(); iblock++) steps += " " + std::to_string(workspace_.coolingSteps()[iblock]);
+        LogDebug("PrimaryVertexProducer_Alpaka") << "Temperature steps taken by each clusterizer block:" << steps;
+      }
+      // Only the good vertices go in the event, so the transfer to the host and the conversion to reco::Vertex scale with them and not with the capacity
+      int32_t nGood = std::min(workspace_.vertexCount(), deviceVertex_->view().metadata().size());
+      portablevertex::VertexDeviceCollection outputVertex(std::max(nGood, 1), iEvent.queue()); // A collection keeps at least one row, which carries nV = 0 in empty events
+      outputKernel_.compact(iEvent.queue(), iEvent.get(trackToken_), *deviceVertex_, outputVertex, nGood);
+      iEvent.emplace(devicePutToken_, std::move(outputVertex));
+      deviceVertex_.reset();
     }
 
     static void fillDescriptions(edm::ConfigurationDescriptions& descriptions) {
@@ -115,11 +179,19 @@ namespace ALPAKA_ACCELERATOR_NAMESPACE {
       desc.add<edm::InputTag>("BeamSpotLabel");
       desc.add<double>("blockOverlap");
       desc.add<int32_t>("blockSize");
+      desc.add<int32_t>("blockPartitioning", 0)->setComment("0: fixed-size blocks overlapping by blockOverlap, 1: blocks cut at the largest z gaps, sharing only blockHalo tracks with their neighbours");
+      desc.add<int32_t>("blockHalo", 16)->setComment("Tracks copied from each neighbouring block when blockPartitioning is 1, at most blockSize/4");
+      desc.add<int32_t>("tracksPerVertexSlot", 8)->setComment("Number of tracks per block for each vertex slot added to the pool");
+      desc.add<int32_t>("minVerticesPerBlock", 16)->setComment("Minimum number of vertex slots added to the pool per block, regardless of multiplicity");
+      desc.add<double>("vertexListHeadroom", 2.0)->setComment("Capacity of the ordered vertex list of each block, in units of the slots it adds to the pool. A block needing more vertices than that reports an overflow");
+      desc.add<int32_t>("trackVertexWindow", 16)->setComment("Average number of nearby vertices per track whose assignment terms are cached, beyond that they are recomputed");
+      desc.add<double>("expCacheTolerance", 0.)->setComment("Largest change of the exponent of a cached track-vertex term for which it is reused, i.e. the relative accuracy of the reused terms. The default 0 disables the reuse across iterations and does not allocate the stored exponents, each term is only computed once per update and shared by its two passes, so the output is the same as without the cache. Larger values change the vertices slightly and are only meant to be set after comparing the output with the default");
       edm::ParameterSetDescription parf0;
       parf0.add<double>("chi2cutoff", 2.5);
       parf0.add<double>("minNdof", 0.0);
       parf0.add<bool>("useBeamSpotConstraint", true);
       parf0.add<double>("maxDistanceToBeam", 1.0);
+      parf0.add<int32_t>("mode", 0)->setComment("0: one thread per vertex, 1: one block per vertex, which balances the load of vertices with many tracks");
       desc.add<edm::ParameterSetDescription>("TkFitterParameters",parf0);
       edm::ParameterSetDescription parc0;
       parc0.add<double>("d0CutOff", 3.0);
@@ -128,7 +200,7 @@ namespace ALPAKA_ACCELERATOR_NAMESPACE {
       parc0.add<double>("zmerge", 0.01);
       parc0.add<double>("dzCutOff", 3.0);
       parc0.add<double>("Tpurge", 2.0);
-      parc0.add<int32_t>("convergence_mode", 0);
+      parc0.add<int32_t>("convergence_mode", 0)->setComment("0: thermalization stops once no vertex moves more than delta_highT, 1: more than delta_lowT/sqrt(beta)");
       parc0.add<double>("delta_highT", 0.01);
       parc0.add<double>("Tstop", 0.5);
       parc0.add<double>("coolingFactor", 0.6);
@@ -136,6 +208,12 @@ namespace ALPAKA_ACCELERATOR_NAMESPACE {
       parc0.add<double>("uniquetrkweight", 0.8);
       parc0.add<double>("uniquetrkminp", 0.0);
       parc0.add<double>("zrange", 4.0);
+      parc0.add<int32_t>("seeding_mode", 0)->setComment("0: start each block from a single vertex, 1: from the peaks of the weighted track z histogram, at a lower temperature");
+      parc0.add<double>("seed_binSize", 0.02)->setComment("Bin width of the seeding histogram, in cm");
+      parc0.add<double>("seed_minWeight", 2.0)->setComment("Smallest summed track weight of a histogram peak to seed a vertex");
+      parc0.add<int32_t>("cooling_mode", 0)->setComment("0: fixed coolingFactor steps, 1: adaptive steps, larger while nothing splits and smaller while vertices split");
+      parc0.add<double>("cooling_minFactor", 0.2)->setComment("Smallest cooling factor, i.e. largest temperature step, of the adaptive mode");
+      parc0.add<int32_t>("cooling_quietIterations", 3)->setComment("In the adaptive mode, a step without splits whose thermalization took at most this many iterations makes the next step larger");
       desc.add<edm::ParameterSetDescription>("TkClusParameters",parc0);
       descriptions.addWithDefaultLabel(desc);
     }
@@ -146,9 +224,26 @@ namespace ALPAKA_ACCELERATOR_NAMESPACE {
     device::EDPutToken<portablevertex::VertexDeviceCollection> devicePutToken_;
     int32_t blockSize;
     double blockOverlap;
+    int32_t blockPartitioning;
+    int32_t blockHalo;
+    int32_t tracksPerVertexSlot;
+    int32_t minVerticesPerBlock;
+    double vertexListHeadroom;
+    int32_t trackVertexWindow;
+    double expCacheTolerance;
+    bool reportCoolingSteps_ = false;
     fitterParameters fitterParams;
     clusterParameters clusterParams;
     std::shared_ptr<portablevertex::ClusterParamsHostCollection> cParams;
+    std::optional<ClusterParamsCollection> cParamsDevice_; // Device copy of cParams, the only one the kernels see
+    // Algorithms and scratch memory, a stream module has one instance per stream so these are never shared between concurrent events
+    BlockAlgo blockKernel_;
+    std::optional<ClusterizerAlgo> clusterizerKernel_;
+    std::optional<FitterAlgo> fitterKernel_;
+    OutputAlgo outputKernel_;
+    VertexingWorkspace workspace_;
+    // Vertices of the event being processed, created in acquire() and moved into the event in produce()
+    std::optional<portablevertex::VertexDeviceCollection> deviceVertex_;
   };
 
 }  // namespace ALPAKA_ACCELERATOR_NAMESPACE
@@ -0,0 +1,141 @@
+#include <alpaka/alpaka.hpp>
+#include <algorithm>
+
+#include "HeterogeneousCore/AlpakaInterface/interface/config.h"
+#include "HeterogeneousCore/AlpakaInterface/interface/EventCache.h"
+
+#include "RecoVertex/PrimaryVertexProducer_Alpaka/plugins/alpaka/VertexingWorkspace.h"
+
+namespace ALPAKA_ACCELERATOR_NAMESPACE {
+
+  VertexingWorkspace::VertexingWorkspace() {
+  } // VertexingWorkspace::VertexingWorkspace
+
+  void VertexingWorkspace::acquire(Queue& queue){
+    // The previous event might still be running on the device, possibly in another queue. The wait happens on the device, the host moves on
+    if (lastUse_) alpaka::wait(queue, *lastUse_);
+  } // VertexingWorkspace::acquire
+
+  void VertexingWorkspace::release(Queue& queue){
+    lastUse_ = cms::alpakatools::getEventCache<Event>().get(alpaka::getDev(queue));
+    alpaka::enqueue(queue, *lastUse_);
+  } // VertexingWorkspace::release
+
+  int32_t VertexingWorkspace::grow(int32_t capacity, int32_t needed){
+    // Grow geometrically so a slowly increasing multiplicity does not trigger a reallocation on every event
+    return std::max(needed, static_cast<int32_t>(growthFactor_ * capacity));
+  } // VertexingWorkspace::grow
+
+  clusterizerWorkspace VertexingWorkspace::clusterizer(Queue& queue, int32_t nBlocks, int32_t blockSize, int32_t maxVerticesPerBlock, int32_t maxVertices, int32_t nTrackIndices, int32_t trackVertexCapacity, double expCacheTolerance){
+    if (not overflowDevice_){
+      overflowDevice_.emplace(cms::alpakatools::make_device_buffer<int32_t>(queue));
+      overflowHost_.emplace(cms::alpakatools::make_host_buffer<int32_t>(queue));
+    }
+    int32_t needed = clusterizerWorkspace::scratchSize(nBlocks, blockSize, maxVerticesPerBlock, maxVertices, nTrackIndices);
+    if (not clusterizerScratch_ or alpaka::getExtentProduct(*clusterizerScratch_) < static_cast<size_t>(needed)){
+      int32_t capacity = clusterizerScratch_ ? grow(alpaka::getExtentProduct(*clusterizerScratch_), needed) : needed;
+      clusterizerScratch_.emplace(cms::alpakatools::make_device_buffer<int32_t[]>(queue, capacity));
+    }
+    int32_t neededDouble = clusterizerWorkspace::doubleScratchSize(nBlocks, blockSize, maxVerticesPerBlock, trackVertexCapacity, expCacheTolerance);
+    if (not clusterizerDoubleScratch_ or alpaka::getExtentProduct(*clusterizerDoubleScratch_) < static_cast<size_t>(neededDouble)){
+      int32_t capacity = clusterizerDoubleScratch_ ? grow(alpaka::getExtentProduct(*clusterizerDoubleScratch_), neededDouble) : neededDouble;
+      clusterizerDoubleScratch_.emplace(cms::alpakatools::make_device_buffer<double[]>(queue, capacity));
+    }
+    // The lists are filled by the kernels themselves, only the counters shared by all blocks have to start from 0
+    int32_t* order = clusterizerScratch_->data();
+    int32_t* freeSlots = order + nBlocks*maxVerticesPerBlock;
+    int32_t* nFreeSlots = freeSlots + nBlocks*maxVerticesPerBlock;
+    int32_t* poolTop = nFreeSlots + nBlocks;
+    int32_t* firstTrack = poolTop + 1;
+    int32_t* lastTrack = firstTrack + nBlocks*maxVerticesPerBlock;
+    int32_t* positionMap = lastTrack + nBlocks*maxVerticesPerBlock;
+    int32_t* orderScratch = positionMap + nBlocks*(maxVerticesPerBlock + 1);
+    int32_t* newSlots = orderScratch + nBlocks*maxVerticesPerBlock;
+    int32_t* trackVertexOffset = newSlots + nBlocks*maxVerticesPerBlock;
+    int32_t* trackOwner = trackVertexOffset + nBlocks*blockSize;
+    int32_t* nArbitrated = trackOwner + nTrackIndices;
+    int32_t* arbitrationCount = nArbitrated + 1;
+    int32_t* vertexTracks = arbitrationCount + nBlocks;
+    int32_t* vertexFill = vertexTracks + maxVertices;
+    int32_t* finalPosition = vertexFill + maxVertices;
+    int32_t* coolingSteps = finalPosition + maxVertices + 1;
+    int32_t* blockTrackStart = coolingSteps + nBlocks;
+    int32_t* blockTrackCount = blockTrackStart + nBlocks;
+    int32_t* trackKmin = blockTrackCount + nBlocks;
+    int32_t* trackKmax = trackKmin + nBlocks*blockSize;
+    int32_t* spanOffset = trackKmax + nBlocks*blockSize;
+    int32_t* trackKmaxPrefix = spanOffset + nBlocks*(maxVerticesPerBlock + 1);
+    int32_t* trackKminSuffix = trackKmaxPrefix + nBlocks*blockSize;
+    double* trackVertexExp = clusterizerDoubleScratch_->data();
+    double* trackVertexArg = expCacheTolerance > 0 ? trackVertexExp + nBlocks*trackVertexCapacity : nullptr; // Only needed to compare exponents, with no tolerance the terms are just recomputed
+    double* splitHalves = trackVertexExp + (expCacheTolerance > 0 ? 2 : 1)*nBlocks*trackVertexCapacity;
+    double* orderedZ = splitHalves + 4*nBlocks*maxVerticesPerBlock;
+    double* arbitrationZ = orderedZ + nBlocks*maxVerticesPerBlock;
+    double* arbitrationRho = arbitrationZ + nBlocks*maxVerticesPerBlock;
+    double* blockZRange = arbitrationRho + nBlocks*maxVerticesPerBlock;
+    double* trackZ = blockZRange + 2*nBlocks;
+    double* trackWeight = trackZ + nBlocks*blockSize;
+    double* trackOneOverDz2 = trackWeight + nBlocks*blockSize;
+    double* trackSumZ = trackOneOverDz2 + nBlocks*blockSize;
+    double* trackAux1 = trackSumZ + nBlocks*blockSize;
+    double* trackAux2 = trackAux1 + nBlocks*blockSize;
+    double* spanSums = trackAux2 + nBlocks*blockSize;
+    clusterizerWorkspace ws{blockSize, maxVerticesPerBlock, maxVertices, nTrackIndices, overflowDevice_->data(),
+                            order, freeSlots, nFreeSlots, poolTop, firstTrack, lastTrack, positionMap, orderScratch, newSlots, trackVertexOffset, trackOwner,
+                            nArbitrated, arbitrationCount, vertexTracks, vertexFill, finalPosition, coolingSteps, blockTrackStart, blockTrackCount, trackKmin, trackKmax, spanOffset, trackKmaxPrefix, trackKminSuffix, trackVertexCapacity, expCacheTolerance, trackVertexExp, trackVertexArg, splitHalves, orderedZ, arbitrationZ, arbitrationRho, blockZRange, trackZ, trackWeight, trackOneOverDz2, trackSumZ, trackAux1, trackAux2, spanSums,
+                            seedingSingleVertex, 0., 0., coolingFixed, 0., 0, nullptr}; // Seeding and cooling options are filled by the caller, the shared scratch by the kernels
+    nBlocks_ = nBlocks;
+    coolingStepsDevice_ = coolingSteps;
+    alpaka::memset(queue, *overflowDevice_, 0);
+    alpaka::memset(queue, cms::alpakatools::make_device_view(alpaka::getDev(queue), *ws.poolTop), 0);
+    alpaka::memset(queue, cms::alpakatools::make_device_view(alpaka::getDev(queue), *ws.nArbitrated), 0);
+    return ws;
+  } // VertexingWorkspace::clusterizer
+
+  fitterWorkspace VertexingWorkspace::fitter(Queue& queue, int32_t maxVertices, int32_t maxTracks){
+    int32_t needed = maxVertices + 1;
+    if (not fitterScratch_ or alpaka::getExtentProduct(*fitterScratch_) < static_cast<size_t>(needed)){
+      int32_t capacity = fitterScratch_ ? grow(alpaka::getExtentProduct(*fitterScratch_), needed) : needed;
+      fitterScratch_.emplace(cms::alpakatools::make_device_buffer<int32_t[]>(queue, capacity));
+    }
+    maxTracks = std::max(maxTracks, 1); // Keeps the buffer valid for events without tracks
+    int32_t neededDouble = fitterWorkspace::doubleScratchSize(maxTracks);
+    if (not fitterDoubleScratch_ or alpaka::getExtentProduct(*fitterDoubleScratch_) < static_cast<size_t>(neededDouble)){
+      int32_t capacity = fitterDoubleScratch_ ? grow(alpaka::getExtentProduct(*fitterDoubleScratch_), neededDouble) : neededDouble;
+      fitterDoubleScratch_.emplace(cms::alpakatools::make_device_buffer<double[]>(queue, capacity));
+    }
+    // Nothing to reset, the offsets and the copies are fully written by the fitter before it reads them
+    double* trackX = fitterDoubleScratch_->data();
+    return fitterWorkspace{fitterScratch_->data(), trackX, trackX + maxTracks, trackX + 2*maxTracks, trackX + 3*maxTracks, trackX + 4*maxTracks, trackX + 5*maxTracks, trackX + 6*maxTracks, trackX + 7*maxTracks};
+  } // VertexingWorkspace::fitter
+
+  void VertexingWorkspace::copyOverflowToHost(Queue& queue){
+    alpaka::memcpy(queue, *overflowHost_, *overflowDevice_);
+  } // VertexingWorkspace::copyOverflowToHost
+
+  int32_t VertexingWorkspace::overflowFlags() const{
+    return *overflowHost_->data();
+  } // VertexingWorkspace::overflowFlags
+
+  void VertexingWorkspace::copyVertexCountToHost(Queue& queue, portablevertex::VertexDeviceCollection& deviceVertex){
+    if (not vertexCountHost_) vertexCountHost_.emplace(cms::alpakatools::make_host_buffer<int32_t>(queue));
+    alpaka::memcpy(queue, *vertexCountHost_, cms::alpakatools::make_device_view(alpaka::getDev(queue), deviceVertex.view()[0].nV()));
+  } // VertexingWorkspace::copyVertexCountToHost
+
+  int32_t VertexingWorkspace::vertexCount() const{
+    return *vertexCountHost_->data();
+  } // VertexingWorkspace::vertexCount
+
+  void VertexingWorkspace::copyCoolingStepsToHost(Queue& queue){
+    if (not coolingStepsHost_ or alpaka::getExtentProduct(*coolingStepsHost_) < static_cast<size_t>(nBlocks_)){
+      int32_t capacity = coolingStepsHost_ ? grow(alpaka::getExtentProduct(*coolingStepsHost_), nBlocks_) : nBlocks_;
+      coolingStepsHost_.emplace(cms::alpakatools::make_host_buffer<int32_t[]>(queue, capacity));
+    }
+    alpaka::memcpy(queue, *coolingStepsHost_, cms::alpakatools::make_device_view(alpaka::getDev(queue), coolingStepsDevice_, nBlocks_), nBlocks_);
+  } // VertexingWorkspace::copyCoolingStepsToHost
+
+  const int32_t* VertexingWorkspace::coolingSteps() const{
+    return coolingStepsHost_->data();
+  } // VertexingWorkspace::coolingSteps
+
+} // namespace ALPAKA_ACCELERATOR_NAMESPACE
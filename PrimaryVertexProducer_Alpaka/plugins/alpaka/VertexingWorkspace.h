@@ -0,0 +1,55 @@
+#ifndef RecoVertex_PrimaryVertexProducer_Alpaka_plugins_alpaka_VertexingWorkspace_h
+#define RecoVertex_PrimaryVertexProducer_Alpaka_plugins_alpaka_VertexingWorkspace_h
+
+#include <memory>
+#include <optional>
+
+#include "DataFormats/PortableVertex/interface/alpaka/VertexDeviceCollection.h"
+#include "HeterogeneousCore/AlpakaInterface/interface/config.h"
+#include "HeterogeneousCore/AlpakaInterface/interface/memory.h"
+
+#include "RecoVertex/PrimaryVertexProducer_Alpaka/plugins/alpaka/ClusterizerAlgo.h"
+#include "RecoVertex/PrimaryVertexProducer_Alpaka/plugins/alpaka/FitterAlgo.h"
+
+namespace ALPAKA_ACCELERATOR_NAMESPACE {
+
+  /**
+   * Per-stream scratch memory of the vertexing, reused across events:
+   * - buffers only grow (geometrically) when an event needs more than the current high-water mark, so the steady state does no allocations
+   * - as consecutive events might run on different queues, the use of the buffers is serialized through an alpaka event
+   * Usage is acquire(queue), get the buffers, enqueue the work, release(queue)
+   */
+  class VertexingWorkspace {
+  public:
+    VertexingWorkspace();
+    void acquire(Queue& queue); // Make the queue wait (on device) until the previous event is done with the buffers
+    void release(Queue& queue); // Mark the end of the work using the buffers in this event
+    clusterizerWorkspace clusterizer(Queue& queue, int32_t nBlocks, int32_t blockSize, int32_t maxVerticesPerBlock, int32_t maxVertices, int32_t nTrackIndices, int32_t trackVertexCapacity, double expCacheTolerance); // Clusterizer scratch for this event, with the overflow flag and the vertex pool reset
+    fitterWorkspace fitter(Queue& queue, int32_t maxVertices, int32_t maxTracks); // Vertex-ordered fit inputs for this event, filled by the fitter itself
+    void copyOverflowToHost(Queue& queue); // Enqueue the copy of the device flag to the host
+    int32_t overflowFlags() const; // Host copy of the flag, only valid once the queue has completed the copy
+    void copyVertexCountToHost(Queue& queue, portablevertex::VertexDeviceCollection& deviceVertex); // Enqueue the copy of the final number of vertices to the host
+    int32_t vertexCount() const; // Host copy of the number of vertices, only valid once the queue has completed the copy
+    void copyCoolingStepsToHost(Queue& queue); // Enqueue the copy of the per-block temperature step counts of the last clusterizer() event to the host
+    const int32_t* coolingSteps() const; // Host copy of the step counts, nBlocks() entries, only valid once the queue has completed the copy
+    int32_t nBlocks() const { return nBlocks_; } // Number of blocks of the last clusterizer() event
+
+  private:
+    static constexpr double growthFactor_ = 1.5;
+    static int32_t grow(int32_t capacity, int32_t needed);
+    std::optional<cms::alpakatools::device_buffer<Device, int32_t[]>> clusterizerScratch_;
+    std::optional<cms::alpakatools::device_buffer<Device, double[]>> clusterizerDoubleScratch_;
+    std::optional<cms::alpakatools::device_buffer<Device, int32_t[]>> fitterScratch_;
+    std::optional<cms::alpakatools::device_buffer<Device, double[]>> fitterDoubleScratch_;
+    std::optional<cms::alpakatools::device_buffer<Device, int32_t>> overflowDevice_;
+    std::optional<cms::alpakatools::host_buffer<int32_t>> overflowHost_;
+    std::optional<cms::alpakatools::host_buffer<int32_t>> vertexCountHost_;
+    std::optional<cms::alpakatools::host_buffer<int32_t[]>> coolingStepsHost_;
+    int32_t* coolingStepsDevice_ = nullptr;
+    int32_t nBlocks_ = 0;
+    std::shared_ptr<Event> lastUse_;
+  };
+
+}  // namespace ALPAKA_ACCELERATOR_NAMESPACE
+
+#endif  // RecoVertex_PrimaryVertexProducer_Alpaka_plugins_alpaka_VertexingWorkspace_h
@@ -106,11 +106,19 @@ process.vertexSoA = cms.EDProducer("PrimaryVertexProducer_Alpaka@alpaka",
     BeamSpotLabel = cms.InputTag("beamSpotSoA"),
     blockOverlap = cms.double(0.50),
     blockSize    = cms.int32(512),
+    blockPartitioning = cms.int32(0), # 0 = fixed overlap, 1 = cut at z gaps with a halo
+    blockHalo = cms.int32(16),
+    tracksPerVertexSlot = cms.int32(8),
+    minVerticesPerBlock = cms.int32(16),
+    vertexListHeadroom = cms.double(2.0),
+    trackVertexWindow = cms.int32(16),
+    expCacheTolerance = cms.double(0.),
     TkFitterParameters = cms.PSet(
         chi2cutoff = cms.double(2.5),
         minNdof=cms.double(0.0),
         useBeamSpotConstraint = cms.bool(True),
-        maxDistanceToBeam = cms.double(1.0)
+        maxDistanceToBeam = cms.double(1.0),
+        mode = cms.int32(0)
     ),
     TkClusParameters = cms.PSet(    
         coolingFactor = cms.double(0.6),  # moderate annealing speed
@@ -127,6 +135,12 @@ process.vertexSoA = cms.EDProducer("PrimaryVertexProducer_Alpaka@alpaka",
         zmerge = cms.double(1e-2),        # merge intermediat clusters separated by less than zmerge
         uniquetrkweight = cms.double(0.8),# require at least two tracks with this weight at T=Tpurge
         uniquetrkminp = cms.double(0.0),  # minimal a priori track weight for counting unique tracks
+        seeding_mode = cms.int32(0),      # 0 = single vertex per block, 1 = peaks of the track z histogram
+        seed_binSize = cms.double(0.02),  # histogram bin width for seeding_mode 1
+        seed_minWeight = cms.double(2.0), # minimal summed track weight of a seeding peak
+        cooling_mode = cms.int32(0),      # 0 = fixed coolingFactor, 1 = adaptive steps following split activity
+        cooling_minFactor = cms.double(0.2), # largest step of the adaptive cooling
+        cooling_quietIterations = cms.int32(3), # thermalize iterations below which the adaptive cooling speeds up
     ) 
 )
 